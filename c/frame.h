@@ -0,0 +1,272 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+/*
+ * wire format shared by pollserver and pollclient.
+ *
+ * every message travels as a frame:
+ *   varint payload length | 1 byte frame type | payload
+ * the length is an unsigned LEB128 varint, so short chat lines cost only
+ * two bytes of header.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define FRAME_MAX_VARINT 10                // a 64bit varint never exceeds this
+#define FRAME_MAX_HEADER (FRAME_MAX_VARINT + 1)
+#define FRAME_MAX_PAYLOAD (1u << 24)       // larger frames are a protocol error
+#define FRAME_READER_INITIAL 4096          // initial receive buffer size
+#define CHANNEL_NAME_MAX 255               // channel names fit in one byte
+
+/*
+ * FRAME_MSG payloads start with the channel they are published on:
+ *   1 byte name length | name | message text
+ * the empty name is the lobby every connection joins on connect.
+ * FRAME_HISTORY carries the same payload for a message published before
+ * the receiver joined, so clients can tell stale messages from live ones
+ */
+enum frame_type {
+  FRAME_MSG = 1,      // chat message published on a channel
+  FRAME_JOIN = 2,     // subscribe to the channel named by the payload
+  FRAME_LEAVE = 3,    // unsubscribe from the channel named by the payload
+  FRAME_PING = 4,     // heartbeat from a server to a quiet client
+  FRAME_PONG = 5,     // reply to FRAME_PING
+  FRAME_HISTORY = 6,  // FRAME_MSG replayed to a joiner from channel history
+};
+
+/*
+ * a decoded frame, data points into the reader buffer and stays valid
+ * until the next call to frame_reader_fill
+ */
+struct frame {
+  uint8_t type;
+  uint32_t len;
+  char *data;
+};
+
+/*
+ * incremental frame parser, bytes are received into buf[tail..cap) and
+ * frames are parsed out of buf[head..tail). the buffer only ever grows, so
+ * once it has seen a large message the next one costs no reallocation.
+ */
+struct frame_reader {
+  char *buf;
+  size_t cap;
+  size_t head;  // start of unparsed data
+  size_t tail;  // end of received data
+};
+
+/*
+ * encodes v as a varint into out
+ * return the number of bytes written
+ */
+static inline size_t varint_encode(uint64_t v, uint8_t *out) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    out[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  out[n++] = (uint8_t)v;
+  return n;
+}
+
+/*
+ * decodes a varint from the first avail bytes of in
+ * return the number of bytes consumed, 0 if more bytes are needed and
+ * -1 if the varint is malformed
+ */
+static inline int varint_decode(const uint8_t *in, size_t avail,
+                                uint64_t *v) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < avail && i < FRAME_MAX_VARINT; ++i) {
+    result |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      *v = result;
+      return (int)i + 1;
+    }
+  }
+  return avail >= FRAME_MAX_VARINT ? -1 : 0;
+}
+
+/*
+ * writes the header of a frame carrying len bytes of payload into out,
+ * out must have room for FRAME_MAX_HEADER bytes
+ * return the header length
+ */
+static inline size_t frame_header_encode(uint8_t type, size_t len,
+                                         uint8_t *out) {
+  size_t n = varint_encode(len, out);
+  out[n++] = type;
+  return n;
+}
+
+/*
+ * return 0 on success, -1 if the buffer could not be allocated
+ */
+static inline int frame_reader_init(struct frame_reader *r, size_t cap) {
+  r->buf = malloc(cap);
+  r->cap = r->buf ? cap : 0;
+  r->head = r->tail = 0;
+  return r->buf ? 0 : -1;
+}
+
+static inline void frame_reader_free(struct frame_reader *r) {
+  free(r->buf);
+  r->buf = NULL;
+  r->cap = r->head = r->tail = 0;
+}
+
+/*
+ * make sure a frame of total bytes starting at head fits in the buffer,
+ * moving the unparsed bytes to the front and growing the buffer if needed
+ * return 0 on success, -1 on allocation failure
+ */
+static inline int frame_reader_reserve(struct frame_reader *r, size_t total) {
+  if (r->head > 0 && r->head + total > r->cap) {
+    memmove(r->buf, r->buf + r->head, r->tail - r->head);
+    r->tail -= r->head;
+    r->head = 0;
+  }
+  if (total > r->cap) {
+    size_t cap = r->cap ? r->cap : FRAME_READER_INITIAL;
+    while (cap < total) cap *= 2;
+    char *buf = realloc(r->buf, cap);
+    if (buf == NULL) return -1;
+    r->buf = buf;
+    r->cap = cap;
+  }
+  return 0;
+}
+
+/*
+ * receives whatever is available on fd into the reader
+ * return the value of recv
+ */
+static inline ssize_t frame_reader_fill(struct frame_reader *r, int fd) {
+  if (r->head == r->tail) {
+    r->head = r->tail = 0;
+  } else if (r->tail == r->cap) {
+    if (frame_reader_reserve(r, r->tail - r->head + 1) == -1) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  ssize_t nbytes = recv(fd, r->buf + r->tail, r->cap - r->tail, 0);
+  if (nbytes > 0) r->tail += nbytes;
+  return nbytes;
+}
+
+/*
+ * parses the next complete frame out of the reader
+ * return 1 if f was filled, 0 if more bytes are needed and -1 if the
+ * stream is corrupt or a frame could not be buffered
+ */
+static inline int frame_reader_next(struct frame_reader *r, struct frame *f) {
+  const uint8_t *p = (const uint8_t *)r->buf + r->head;
+  size_t avail = r->tail - r->head;
+  uint64_t len;
+  int n = varint_decode(p, avail, &len);
+  if (n <= 0) return n;
+  if (len > FRAME_MAX_PAYLOAD) return -1;
+  size_t total = n + 1 + len;
+  if (avail < total) {
+    // grow once up front so the rest of a large frame lands in place
+    return frame_reader_reserve(r, total) == -1 ? -1 : 0;
+  }
+  f->type = p[n];
+  f->len = (uint32_t)len;
+  f->data = r->buf + r->head + n + 1;
+  r->head += total;
+  return 1;
+}
+
+/*
+ * splits a FRAME_MSG payload into its channel name and message text
+ * return 0 on success, -1 if the payload is malformed
+ */
+static inline int frame_msg_split(const struct frame *f, const char **chan,
+                                  size_t *chan_len, const char **text,
+                                  size_t *text_len) {
+  if (f->len < 1 || (size_t)(uint8_t)f->data[0] + 1 > f->len) return -1;
+  *chan_len = (uint8_t)f->data[0];
+  *chan = f->data + 1;
+  *text = f->data + 1 + *chan_len;
+  *text_len = f->len - 1 - *chan_len;
+  return 0;
+}
+
+/*
+ * sends a frame whose payload is the concatenation of parts on a blocking
+ * socket, at most 7 parts
+ * return 0 on success, -1 on error
+ */
+static inline int frame_sendv(int fd, uint8_t type, const struct iovec *parts,
+                              int nparts) {
+  uint8_t hdr[FRAME_MAX_HEADER];
+  struct iovec iov[8];
+  size_t len = 0;
+  for (int i = 0; i < nparts; ++i) {
+    iov[i + 1] = parts[i];
+    len += parts[i].iov_len;
+  }
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = frame_header_encode(type, len, hdr);
+  size_t left = iov[0].iov_len + len;
+  struct iovec *v = iov;
+  int cnt = nparts + 1;
+  while (left > 0) {
+    ssize_t n = writev(fd, v, cnt);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    left -= n;
+    while (cnt > 0 && (size_t)n >= v->iov_len) {
+      n -= v->iov_len;
+      ++v;
+      --cnt;
+    }
+    if (cnt > 0) {
+      v->iov_base = (char *)v->iov_base + n;
+      v->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+/*
+ * sends a frame with a single payload buffer
+ */
+static inline int frame_send(int fd, uint8_t type, const void *data,
+                             size_t len) {
+  struct iovec part = {(void *)data, len};
+  return frame_sendv(fd, type, &part, 1);
+}
+
+/*
+ * publishes text on the channel chan
+ */
+static inline int frame_send_msg(int fd, const char *chan, const void *text,
+                                 size_t len) {
+  size_t chan_len = strlen(chan);
+  if (chan_len > CHANNEL_NAME_MAX) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  uint8_t prefix = (uint8_t)chan_len;
+  struct iovec parts[3] = {
+      {&prefix, 1},
+      {(void *)chan, chan_len},
+      {(void *)text, len},
+  };
+  return frame_sendv(fd, FRAME_MSG, parts, 3);
+}
+
+#endif  // FRAME_H
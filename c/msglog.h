@@ -0,0 +1,432 @@
+#ifndef MSGLOG_H
+#define MSGLOG_H
+
+/*
+ * append-only log of published messages, for pollserver. link with
+ * -pthread.
+ *
+ * the event loop only copies a record into an in-memory single producer,
+ * single consumer ring. a writer thread moves records from there into a
+ * memory-mapped segment file and msyncs whatever it wrote since the last
+ * sync in one go, so every message that arrived in the meantime shares the
+ * flush. with a durability window the writer waits out the rest of the
+ * window after each sync, trading up to that much extra loss on a power
+ * cut for fewer, larger flushes. a server that merely dies loses nothing
+ * that left the ring, the page cache still has it.
+ *
+ * the log is a directory of fixed size segments named after the sequence
+ * number of their first record, %020llu.log. a segment starts with
+ *   u32 magic | u32 version | u64 first sequence
+ * followed by records padded to 8 bytes:
+ *   u32 length | u32 checksum | the encoded frame, as sent to subscribers
+ * the file is created zero filled, so a zero length ends a segment. a bad
+ * checksum means a write torn by a crash and ends it too. a restarted
+ * server never appends to an old segment, it replays them and starts a new
+ * one. only the newest MSGLOG_KEEP segments are kept.
+ *
+ * every block of a segment is allocated when it is created. a store into
+ * the mapping can only report a full disk with SIGBUS, so running out of
+ * space has to show up as a failed roll instead.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MSGLOG_RING_SIZE (16u << 20)     // bytes queued for the writer
+#define MSGLOG_SEGMENT_SIZE (64u << 20)  // bytes per segment file
+#define MSGLOG_KEEP 8                    // segments kept on disk
+#define MSGLOG_MAGIC 0x676f6c70          // "plog"
+#define MSGLOG_VERSION 1
+#define MSGLOG_HEADER 16
+#define MSGLOG_RECORD(len) (8 + (((len) + 7) & ~(size_t)7))
+#define MSGLOG_MAX_RECORD (MSGLOG_SEGMENT_SIZE - MSGLOG_HEADER)
+
+/*
+ * head and tail count every byte ever queued and taken, the loop only
+ * stores head and the writer only stores tail. the writer sets
+ * writer_sleeping before it blocks on wake_fd, so a busy log costs the
+ * loop no system calls
+ */
+struct msglog {
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Atomic uint32_t writer_sleeping;
+  _Atomic uint32_t stopping;
+  _Alignas(64) _Atomic uint64_t appended;  // records queued
+  _Atomic uint64_t dropped;   // records that found the ring full
+  _Atomic uint64_t synced;    // records known to be on disk
+  _Atomic uint64_t syncs;     // flushes, synced / syncs is the group size
+  _Atomic uint64_t replayed;  // records read back at startup
+  char *ring;
+  int wake_fd;
+  uint64_t window_ns;
+  pthread_t thread;
+
+  // writer side
+  int dir_fd;
+  int seg_fd;
+  char *seg;
+  size_t seg_off;   // end of the records written to seg
+  size_t sync_off;  // end of the records synced
+  uint64_t seq;     // sequence number of the next record
+  uint64_t segs[MSGLOG_KEEP + 1];  // segments on disk, oldest first
+  int nsegs;
+  int failed;  // the disk gave up on us, records are discarded
+};
+
+/*
+ * called for every record found at startup, data is the encoded frame
+ */
+typedef void (*msglog_replay_fn)(void *arg, const char *data, size_t len);
+
+static inline uint64_t msglog_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * fnv-1a over the length and the payload
+ */
+static inline uint32_t msglog_checksum(const char *data, uint32_t len) {
+  uint32_t h = 2166136261u ^ len;
+  for (uint32_t i = 0; i < len; ++i) {
+    h ^= (uint8_t)data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/*
+ * copies len bytes out of the ring, starting at byte pos
+ */
+static inline void msglog_ring_read(const struct msglog *l, uint64_t pos,
+                                    void *out, size_t len) {
+  size_t off = pos & (MSGLOG_RING_SIZE - 1);
+  size_t first = len < MSGLOG_RING_SIZE - off ? len : MSGLOG_RING_SIZE - off;
+  memcpy(out, l->ring + off, first);
+  memcpy((char *)out + first, l->ring, len - first);
+}
+
+static inline void msglog_ring_write(struct msglog *l, uint64_t pos,
+                                     const void *in, size_t len) {
+  size_t off = pos & (MSGLOG_RING_SIZE - 1);
+  size_t first = len < MSGLOG_RING_SIZE - off ? len : MSGLOG_RING_SIZE - off;
+  memcpy(l->ring + off, in, first);
+  memcpy(l->ring, (const char *)in + first, len - first);
+}
+
+/*
+ * queues one record for the writer, never blocks. the checksum is left to
+ * the writer thread
+ * return 0 on success, -1 if the ring is full and the record was dropped
+ */
+static inline int msglog_append(struct msglog *l, const void *data,
+                                size_t len) {
+  if (len == 0) return 0;  // a zero length marks the end of a segment
+  size_t rec = MSGLOG_RECORD(len);
+  uint64_t head = atomic_load_explicit(&l->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&l->tail, memory_order_acquire);
+  if (rec > MSGLOG_MAX_RECORD || MSGLOG_RING_SIZE - (head - tail) < rec) {
+    atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+    return -1;
+  }
+  static const char zeros[8];
+  uint32_t hdr[2] = {(uint32_t)len, 0};
+  msglog_ring_write(l, head, hdr, sizeof(hdr));
+  msglog_ring_write(l, head + 8, data, len);
+  msglog_ring_write(l, head + 8 + len, zeros, rec - 8 - len);
+  atomic_store(&l->head, head + rec);
+  atomic_fetch_add_explicit(&l->appended, 1, memory_order_relaxed);
+  // seq_cst like the store of head, a weaker load could be satisfied
+  // before head is visible and miss a writer that just went to sleep
+  if (atomic_load(&l->writer_sleeping) &&
+      atomic_exchange(&l->writer_sleeping, 0)) {
+    uint64_t one = 1;
+    ssize_t rv = write(l->wake_fd, &one, sizeof(one));
+    (void)rv;  // a full counter already means a pending wakeup
+  }
+  return 0;
+}
+
+/*
+ * flushes the records written to the current segment since the last sync
+ * return 0 on success, -1 on error
+ */
+static inline int msglog_sync(struct msglog *l) {
+  if (l->seg_off == l->sync_off) return 0;
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t from = l->sync_off & ~(page - 1);
+  if (msync(l->seg + from, l->seg_off - from, MS_SYNC) == -1) return -1;
+  l->sync_off = l->seg_off;
+  atomic_fetch_add_explicit(&l->syncs, 1, memory_order_relaxed);
+  return 0;
+}
+
+/*
+ * syncs and unmaps the current segment and starts a new one at l->seq,
+ * dropping the oldest segments beyond MSGLOG_KEEP
+ * return 0 on success, -1 on error
+ */
+static inline int msglog_roll(struct msglog *l) {
+  if (l->seg != NULL) {
+    if (msglog_sync(l) == -1) return -1;
+    munmap(l->seg, MSGLOG_SEGMENT_SIZE);
+    close(l->seg_fd);
+    l->seg = NULL;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)l->seq);
+  l->seg_fd =
+      openat(l->dir_fd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (l->seg_fd == -1) return -1;
+  int rv = posix_fallocate(l->seg_fd, 0, MSGLOG_SEGMENT_SIZE);
+  if (rv == 0) {
+    l->seg = mmap(NULL, MSGLOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_SHARED, l->seg_fd, 0);
+    rv = l->seg == MAP_FAILED ? errno : 0;
+  }
+  if (rv != 0) {
+    close(l->seg_fd);
+    unlinkat(l->dir_fd, name, 0);
+    l->seg_fd = -1;
+    l->seg = NULL;
+    errno = rv;
+    return -1;
+  }
+  uint32_t hdr[2] = {MSGLOG_MAGIC, MSGLOG_VERSION};
+  memcpy(l->seg, hdr, sizeof(hdr));
+  memcpy(l->seg + 8, &l->seq, sizeof(l->seq));
+  l->seg_off = MSGLOG_HEADER;
+  l->sync_off = 0;  // the header goes out with the first sync
+  // make the new name itself durable
+  if (fsync(l->dir_fd) == -1) return -1;
+
+  l->segs[l->nsegs++] = l->seq;
+  while (l->nsegs > MSGLOG_KEEP) {
+    snprintf(name, sizeof(name), "%020llu.log",
+             (unsigned long long)l->segs[0]);
+    unlinkat(l->dir_fd, name, 0);
+    memmove(l->segs, l->segs + 1, sizeof(l->segs[0]) * --l->nsegs);
+  }
+  return 0;
+}
+
+/*
+ * moves the records in [tail, head) of the ring into the segment
+ * return the new tail
+ */
+static inline uint64_t msglog_drain(struct msglog *l, uint64_t tail,
+                                    uint64_t head) {
+  while (tail != head) {
+    uint32_t hdr[2];
+    msglog_ring_read(l, tail, hdr, sizeof(hdr));
+    size_t rec = MSGLOG_RECORD(hdr[0]);
+    if (!l->failed && l->seg_off + rec > MSGLOG_SEGMENT_SIZE &&
+        msglog_roll(l) == -1) {
+      perror("msglog: segment");
+      l->failed = 1;
+    }
+    if (l->failed) {
+      atomic_fetch_add_explicit(&l->dropped, 1, memory_order_relaxed);
+    } else {
+      char *dst = l->seg + l->seg_off;
+      msglog_ring_read(l, tail, dst, rec);
+      hdr[1] = msglog_checksum(dst + 8, hdr[0]);
+      memcpy(dst + 4, &hdr[1], sizeof(hdr[1]));
+      l->seg_off += rec;
+      l->seq++;
+    }
+    tail += rec;
+  }
+  return tail;
+}
+
+static inline void *msglog_run(void *arg) {
+  struct msglog *l = arg;
+  for (;;) {
+    uint64_t start = msglog_now_ns();
+    uint64_t tail = atomic_load_explicit(&l->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&l->head, memory_order_acquire);
+    if (head != tail) {
+      uint64_t seq = l->seq;
+      // the bytes are in the mapping now, so the loop may reuse the ring
+      // while we wait for the disk
+      atomic_store(&l->tail, msglog_drain(l, tail, head));
+      if (!l->failed && msglog_sync(l) == -1) {
+        perror("msglog: msync");
+        l->failed = 1;
+      }
+      if (!l->failed) {
+        atomic_fetch_add_explicit(&l->synced, l->seq - seq,
+                                  memory_order_relaxed);
+      }
+      uint64_t spent = msglog_now_ns() - start;
+      if (spent < l->window_ns) {
+        uint64_t rest = l->window_ns - spent;
+        struct timespec ts = {rest / 1000000000ULL, rest % 1000000000ULL};
+        nanosleep(&ts, NULL);
+      }
+      continue;
+    }
+    if (atomic_load(&l->stopping)) break;
+    // announce the nap, then look again for records queued meanwhile
+    atomic_store(&l->writer_sleeping, 1);
+    if (atomic_load(&l->head) != tail) {
+      atomic_store(&l->writer_sleeping, 0);
+      continue;
+    }
+    struct pollfd pfd = {.fd = l->wake_fd, .events = POLLIN};
+    poll(&pfd, 1, -1);
+    uint64_t pending;
+    ssize_t rv = read(l->wake_fd, &pending, sizeof(pending));
+    (void)rv;
+  }
+  return NULL;
+}
+
+static inline int msglog_segment_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * reads every record of the segment starting at seq in order, stopping at
+ * the first empty or torn one
+ * return the sequence number after the last record, or seq if the segment
+ * could not be read
+ */
+static inline uint64_t msglog_replay_segment(struct msglog *l, uint64_t seq,
+                                             msglog_replay_fn fn, void *arg) {
+  char name[32];
+  snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)seq);
+  int fd = openat(l->dir_fd, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return seq;
+  struct stat st;
+  char *seg = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size >= MSGLOG_HEADER) {
+    seg = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (seg == MAP_FAILED) return seq;
+  madvise(seg, st.st_size, MADV_SEQUENTIAL);
+
+  uint32_t hdr[2];
+  memcpy(hdr, seg, sizeof(hdr));
+  size_t off = MSGLOG_HEADER;
+  if (hdr[0] == MSGLOG_MAGIC && hdr[1] == MSGLOG_VERSION) {
+    while (off + 8 <= (size_t)st.st_size) {
+      memcpy(hdr, seg + off, sizeof(hdr));
+      size_t rec = MSGLOG_RECORD(hdr[0]);
+      if (hdr[0] == 0 || off + rec > (size_t)st.st_size ||
+          msglog_checksum(seg + off + 8, hdr[0]) != hdr[1]) {
+        break;
+      }
+      if (fn != NULL) fn(arg, seg + off + 8, hdr[0]);
+      off += rec;
+      seq++;
+      atomic_fetch_add_explicit(&l->replayed, 1, memory_order_relaxed);
+    }
+  }
+  munmap(seg, st.st_size);
+  return seq;
+}
+
+/*
+ * opens or creates the log in dir, hands every record already in it to fn
+ * in order, then starts a fresh segment and the writer thread. fn may be
+ * NULL to skip the records
+ * return 0 on success, -1 on error
+ */
+static inline int msglog_open(struct msglog *l, const char *dir,
+                              uint64_t window_ms, msglog_replay_fn fn,
+                              void *arg) {
+  memset(l, 0, sizeof(*l));
+  l->window_ns = window_ms * 1000000ULL;
+  l->seg_fd = -1;
+  if (mkdir(dir, 0755) == -1 && errno != EEXIST) return -1;
+  l->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (l->dir_fd == -1) return -1;
+
+  DIR *d = fdopendir(dup(l->dir_fd));
+  if (d == NULL) return -1;
+  uint64_t *found = NULL;
+  size_t nfound = 0, cap = 0;
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    unsigned long long seq;
+    char tail;
+    if (strlen(e->d_name) != 24 ||
+        sscanf(e->d_name, "%20llu.lo%c", &seq, &tail) != 2 || tail != 'g') {
+      continue;
+    }
+    if (nfound == cap) {
+      cap = cap ? cap * 2 : 16;
+      uint64_t *grown = realloc(found, sizeof(*found) * cap);
+      if (grown == NULL) {
+        free(found);
+        closedir(d);
+        return -1;
+      }
+      found = grown;
+    }
+    found[nfound++] = seq;
+  }
+  closedir(d);
+  qsort(found, nfound, sizeof(*found), msglog_segment_cmp);
+
+  char name[32];
+  for (size_t i = 0; i < nfound; ++i) {
+    uint64_t end = msglog_replay_segment(l, found[i], fn, arg);
+    if (end > l->seq) l->seq = end;
+    snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)found[i]);
+    if (i + 1 == nfound && end == found[i]) {
+      // not a single record, the new segment takes over its name
+      unlinkat(l->dir_fd, name, 0);
+    } else if (i + MSGLOG_KEEP < nfound) {
+      unlinkat(l->dir_fd, name, 0);
+    } else {
+      l->segs[l->nsegs++] = found[i];
+    }
+  }
+  free(found);
+
+  l->ring = malloc(MSGLOG_RING_SIZE);
+  l->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (l->ring == NULL || l->wake_fd == -1 || msglog_roll(l) == -1) return -1;
+  if (pthread_create(&l->thread, NULL, msglog_run, l) != 0) return -1;
+  return 0;
+}
+
+/*
+ * writes out everything still queued and stops the writer
+ */
+static inline void msglog_close(struct msglog *l) {
+  atomic_store(&l->stopping, 1);
+  uint64_t one = 1;
+  ssize_t rv = write(l->wake_fd, &one, sizeof(one));
+  (void)rv;
+  pthread_join(l->thread, NULL);
+  if (l->seg != NULL) {
+    munmap(l->seg, MSGLOG_SEGMENT_SIZE);
+    close(l->seg_fd);
+  }
+  close(l->wake_fd);
+  close(l->dir_fd);
+  free(l->ring);
+}
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE  // SOCK_NONBLOCK
+
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netdb.h>
@@ -7,10 +9,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "shm_ring.h"
+
 void *get_in_addr(struct sockaddr *sa) {
   if (sa->sa_family == AF_INET) {
     return &((struct sockaddr_in *)sa)->sin_addr;
@@ -18,31 +25,32 @@ void *get_in_addr(struct sockaddr *sa) {
   return &((struct sockaddr_in6 *)sa)->sin6_addr;
 }
 
-int mgetline(char buff[], int capacity) {
-  char c;
-  int i = 0;
-  for (; i < capacity - 1 && (c = getchar()) != EOF && c != '\n'; ++i) {
-    buff[i] = c;
+/*
+ * reads a whole line from stdin into *buff, growing it as needed
+ * return the line length without the newline, -1 on EOF
+ */
+ssize_t mgetline(char **buff, size_t *capacity) {
+  ssize_t len = getline(buff, capacity, stdin);
+  if (len > 0 && (*buff)[len - 1] == '\n') {
+    (*buff)[--len] = '\0';
   }
-  buff[i] = '\0';
-  return i;
+  return len;
 }
 
-int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s host port", argv[0]);
-  }
+/*
+ * connects a blocking socket to host:port, exits on failure
+ */
+int connect_to(const char *host, const char *port) {
   int sockfd;
   int rv;
   struct addrinfo hints, *res, *p;
-  char buff[255] = "";
   char serverIp[INET6_ADDRSTRLEN];
 
   memset(&hints, 0, sizeof(hints));
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
 
-  if ((rv = getaddrinfo(argv[1], argv[2], &hints, &res)) != 0) {
+  if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
     exit(EXIT_FAILURE);
   }
@@ -66,39 +74,801 @@ int main(int argc, char *argv[]) {
   inet_ntop(p->ai_family, get_in_addr(p->ai_addr), serverIp, sizeof(serverIp));
   printf("client connected successfully to %s\n", serverIp);
   freeaddrinfo(res);
+  return sockfd;
+}
+
+/*
+ * the server connection of the interactive client, a TCP socket or, with
+ * -u, a shared memory ring pair. fd is what to poll either way
+ */
+struct link {
+  int fd;
+  struct shm_link shm;
+};
+
+int link_sendv(struct link *l, uint8_t type, const struct iovec *parts,
+               int nparts) {
+  if (l->shm.pair != NULL) {
+    return shm_frame_sendv(&l->shm, type, parts, nparts);
+  }
+  return frame_sendv(l->fd, type, parts, nparts);
+}
+
+int link_send(struct link *l, uint8_t type, const void *data, size_t len) {
+  struct iovec part = {(void *)data, len};
+  return link_sendv(l, type, &part, 1);
+}
+
+/*
+ * publishes text on the channel chan, see frame_send_msg
+ */
+int link_send_msg(struct link *l, const char *chan, const void *text,
+                  size_t len) {
+  uint8_t prefix = (uint8_t)strlen(chan);
+  struct iovec parts[3] = {
+      {&prefix, 1},
+      {(void *)chan, prefix},
+      {(void *)text, len},
+  };
+  return link_sendv(l, FRAME_MSG, parts, 3);
+}
+
+ssize_t link_fill(struct link *l, struct frame_reader *r) {
+  if (l->shm.pair != NULL) return shm_link_fill(&l->shm, r);
+  return frame_reader_fill(r, l->fd);
+}
+
+/*
+ * interactive chat on a single connection driven from stdin, over the
+ * shared memory transport when shm_path is set
+ */
+int chat(const char *host, const char *port, const char *shm_path) {
+  char *buff = NULL;
+  size_t buff_cap = 0;
+  int done = 0;
+  char channel[CHANNEL_NAME_MAX + 1] = "";  // where typed lines are published
+  struct frame_reader reader;
+
+  struct link link = {.fd = -1};
+  if (shm_path != NULL) {
+    if (shm_connect(shm_path, &link.shm) == -1) {
+      perror("shm_connect");
+      exit(EXIT_FAILURE);
+    }
+    link.fd = link.shm.wait_fd;
+    printf("client connected through %s\n", shm_path);
+  } else {
+    link.fd = connect_to(host, port);
+  }
+  if (frame_reader_init(&reader, FRAME_READER_INITIAL) == -1) {
+    perror("frame_reader_init");
+    exit(EXIT_FAILURE);
+  }
 
   struct pollfd pfds[2];
   pfds[0].fd = 0;  // standard Input
   pfds[0].events = POLLIN;
-  pfds[1].fd = sockfd;  // server socket
+  pfds[1].fd = link.fd;  // server socket or wakeup eventfd
   pfds[1].events = POLLIN;
 
-  while (strcmp(buff, "quit") != 0) {
+  while (!done) {
     int pollcount = poll(pfds, 2, -1);
     if (pollcount == -1) {
       perror("poll");
       exit(EXIT_FAILURE);
     }
-    if (pfds[0].revents & POLLIN) {  // user entered some input
-      int nbytes = mgetline(buff, 255);
-      if (strcmp(buff, "quit") == 0) {
-        send(sockfd, "bye\0", 4, 0);
+    if (pfds[0].revents & (POLLIN | POLLHUP)) {  // user entered some input
+      ssize_t nbytes = mgetline(&buff, &buff_cap);
+      if (nbytes == -1 || strcmp(buff, "quit") == 0) {
+        link_send_msg(&link, channel, "bye", 3);
+        done = 1;
         continue;
       }
-      if (send(sockfd, buff, nbytes, 0) == -1) {
+      // "/join name" switches to a channel, "/leave name" drops it
+      if (strncmp(buff, "/join ", 6) == 0 || strncmp(buff, "/leave ", 7) == 0) {
+        int join = buff[1] == 'j';
+        const char *name = buff + (join ? 6 : 7);
+        if (strlen(name) > CHANNEL_NAME_MAX) {
+          fprintf(stderr, "channel name too long\n");
+          continue;
+        }
+        if (link_send(&link, join ? FRAME_JOIN : FRAME_LEAVE, name,
+                      strlen(name)) == -1) {
+          perror("send");
+          continue;
+        }
+        if (join) {
+          strcpy(channel, name);
+        } else if (strcmp(channel, name) == 0) {
+          channel[0] = '\0';
+        }
+        continue;
+      }
+      if (link_send_msg(&link, channel, buff, nbytes) == -1) {
         perror("send");
         continue;
       }
     } else {  // server sent some message
-      int nbytes;
-      if ((nbytes = recv(sockfd, buff, sizeof(buff), 0)) == -1) {
+      ssize_t nbytes = link_fill(&link, &reader);
+      if (nbytes <= 0) {
+        if (nbytes == -1 && errno == EAGAIN) continue;
+        if (nbytes == 0) {
+          fprintf(stderr, "server closed the connection\n");
+          break;
+        }
         perror("recv");
         continue;
       }
-      buff[nbytes] = '\0';
-      printf("%s\n", buff);
+      struct frame f;
+      int rv;
+      while ((rv = frame_reader_next(&reader, &f)) == 1) {
+        const char *chan, *text;
+        size_t chan_len, text_len;
+        if (f.type == FRAME_PING) {  // the server checks we are still here
+          link_send(&link, FRAME_PONG, "", 0);
+          continue;
+        }
+        if ((f.type != FRAME_MSG && f.type != FRAME_HISTORY) ||
+            frame_msg_split(&f, &chan, &chan_len, &text, &text_len) == -1) {
+          continue;
+        }
+        if (chan_len > 0) {
+          printf("[%.*s] ", (int)chan_len, chan);
+        }
+        printf("%.*s\n", (int)text_len, text);
+      }
+      if (rv == -1) {
+        fprintf(stderr, "bad frame from server\n");
+        break;
+      }
       fflush(stdout);
     }
   }
+  free(buff);
+  frame_reader_free(&reader);
+  if (link.shm.pair != NULL) {
+    shm_link_close(&link.shm);
+  } else {
+    close(link.fd);
+  }
   return 0;
 }
+
+/*
+ * benchmark settings, see usage()
+ */
+struct bench_opts {
+  int conns;       // connections opened
+  int publishers;  // how many of them send messages
+  double rate;     // messages per second per publisher
+  int size;        // message text size in bytes
+  double seconds;  // how long to send for
+  const char *channel;
+  const char *shm_path;  // publishers use the shared memory transport
+};
+
+/*
+ * log-linear latency histogram in the spirit of HdrHistogram. values below
+ * HIST_SUB are counted exactly, above that every power of two is split into
+ * HIST_SUB / 2 buckets, so any recorded value is within 1/64 of its bucket
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_HALF)
+
+struct histogram {
+  uint64_t counts[HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+};
+
+int hist_bucket(uint64_t v) {
+  if (v < HIST_SUB) return (int)v;
+  int shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+  return HIST_SUB + (shift - 1) * HIST_HALF + (int)((v >> shift) - HIST_HALF);
+}
+
+/*
+ * return the midpoint of the values counted in bucket b
+ */
+uint64_t hist_value(int b) {
+  if (b < HIST_SUB) return b;
+  int shift = (b - HIST_SUB) / HIST_HALF + 1;
+  uint64_t top = (b - HIST_SUB) % HIST_HALF + HIST_HALF;
+  return (top << shift) + ((1ULL << shift) >> 1);
+}
+
+void hist_record(struct histogram *h, uint64_t v) {
+  h->counts[hist_bucket(v)]++;
+  if (h->total == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->total++;
+}
+
+/*
+ * return the value below which the fraction q of the samples fall
+ */
+uint64_t hist_quantile(const struct histogram *h, double q) {
+  uint64_t rank = (uint64_t)(q * h->total);
+  uint64_t seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; ++b) {
+    seen += h->counts[b];
+    if (seen > rank) return hist_value(b) < h->max ? hist_value(b) : h->max;
+  }
+  return h->max;
+}
+
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * one benchmark connection, out holds frames waiting for the next flush
+ */
+struct bench_conn {
+  int fd;
+  int connected;
+  int synced;  // saw a warm up message, so its JOIN went through
+  struct frame_reader reader;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  struct shm_link shm;  // pair is NULL on TCP connections
+};
+
+/*
+ * appends a frame to the output buffer of c
+ * return -1 on allocation failure
+ */
+int bench_queue(struct bench_conn *c, uint8_t type, const void *data,
+                size_t len) {
+  size_t need = c->out_len + FRAME_MAX_HEADER + len;
+  if (need > c->out_cap) {
+    size_t cap = c->out_cap ? c->out_cap : 4096;
+    while (cap < need) cap *= 2;
+    char *out = realloc(c->out, cap);
+    if (out == NULL) return -1;
+    c->out = out;
+    c->out_cap = cap;
+  }
+  c->out_len +=
+      frame_header_encode(type, len, (uint8_t *)c->out + c->out_len);
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+  return 0;
+}
+
+/*
+ * sends as much of the output buffer as the socket takes
+ * return -1 on error
+ */
+int bench_flush(struct bench_conn *c) {
+  if (c->out_len == 0 || !c->connected) return 0;
+  ssize_t n;
+  if (c->shm.pair != NULL) {
+    struct iovec iov = {c->out, c->out_len};
+    n = shm_link_writev(&c->shm, &iov, 1);
+  } else {
+    n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+  }
+  if (n == -1) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+  memmove(c->out, c->out + n, c->out_len - n);
+  c->out_len -= n;
+  return 0;
+}
+
+ssize_t bench_fill(struct bench_conn *c) {
+  if (c->shm.pair != NULL) return shm_link_fill(&c->shm, &c->reader);
+  return frame_reader_fill(&c->reader, c->fd);
+}
+
+/*
+ * answers a heartbeat right away, receivers are not flushed otherwise
+ */
+void bench_pong(struct bench_conn *c) {
+  if (bench_queue(c, FRAME_PONG, "", 0) == 0) bench_flush(c);
+}
+
+/*
+ * return 1 if f is a live message on the benchmark channel, which keeps
+ * history the server replays out of the results
+ */
+int bench_on_channel(const struct bench_opts *o, const struct frame *f,
+                     const char **text, size_t *text_len) {
+  const char *chan, *t;
+  size_t chan_len, tlen;
+  if (f->type != FRAME_MSG ||
+      frame_msg_split(f, &chan, &chan_len, &t, &tlen) == -1 ||
+      chan_len != strlen(o->channel) || memcmp(chan, o->channel, chan_len)) {
+    return 0;
+  }
+  if (text != NULL) {
+    *text = t;
+    *text_len = tlen;
+  }
+  return 1;
+}
+
+/*
+ * raises the descriptor limit as far as the hard limit allows
+ */
+void raise_nofile(int want) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == -1) return;
+  if (rl.rlim_cur < (rlim_t)want) {
+    rl.rlim_cur = rl.rlim_max < (rlim_t)want ? rl.rlim_max : (rlim_t)want;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+/*
+ * opens o->conns connections from a single event loop, publishes
+ * timestamped messages on o->channel at the requested rate and records the
+ * end to end delivery latency of every copy the server fans out
+ */
+int bench(const char *host, const char *port, const struct bench_opts *o) {
+  struct addrinfo hints, *res;
+  int rv;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    return -1;
+  }
+  raise_nofile(o->conns + 16);
+
+  struct bench_conn *conns = calloc(o->conns, sizeof(*conns));
+  struct pollfd *pfds = calloc(o->conns, sizeof(*pfds));
+  struct histogram *hist = calloc(1, sizeof(*hist));
+  size_t chan_len = strlen(o->channel);
+  size_t payload_len = 1 + chan_len + o->size;
+  char *payload = calloc(1, payload_len);
+  if (!conns || !pfds || !hist || !payload) {
+    perror("calloc");
+    return -1;
+  }
+  payload[0] = (char)chan_len;
+  memcpy(payload + 1, o->channel, chan_len);
+  char *stamp = payload + 1 + chan_len;  // send time goes here
+
+  // connect everything up front, keeping a bounded number in flight so
+  // the listen backlog of the server is not overrun
+  uint64_t t0 = now_ns();
+  int opened = 0, connected = 0;
+  while (connected < o->conns) {
+    while (opened < o->conns && opened - connected < 128) {
+      struct bench_conn *c = &conns[opened];
+      if (o->shm_path != NULL && opened < o->publishers) {
+        // the shared memory handshake completes synchronously
+        if (shm_connect(o->shm_path, &c->shm) == -1 ||
+            frame_reader_init(&c->reader, FRAME_READER_INITIAL) == -1 ||
+            bench_queue(c, FRAME_JOIN, o->channel, chan_len) == -1) {
+          perror("shm_connect");
+          return -1;
+        }
+        c->fd = c->shm.wait_fd;
+        c->connected = 1;
+        bench_flush(c);
+        pfds[opened++] = (struct pollfd){.fd = c->fd, .events = POLLIN};
+        connected++;
+        continue;
+      }
+      c->fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (c->fd == -1) {
+        perror("socket");
+        return -1;
+      }
+      if (connect(c->fd, res->ai_addr, res->ai_addrlen) == -1 &&
+          errno != EINPROGRESS) {
+        perror("connect");
+        return -1;
+      }
+      if (frame_reader_init(&c->reader, FRAME_READER_INITIAL) == -1 ||
+          bench_queue(c, FRAME_JOIN, o->channel, chan_len) == -1) {
+        perror("bench_queue");
+        return -1;
+      }
+      pfds[opened] = (struct pollfd){.fd = c->fd, .events = POLLOUT};
+      opened++;
+    }
+    if (poll(pfds, opened, 1000) == -1) {
+      perror("poll");
+      return -1;
+    }
+    for (int i = 0; i < opened; ++i) {
+      if (conns[i].connected || !pfds[i].revents) continue;
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(conns[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+      if (err != 0) {
+        fprintf(stderr, "connect: %s\n", strerror(err));
+        return -1;
+      }
+      conns[i].connected = 1;
+      pfds[i].events = POLLIN;
+      bench_flush(&conns[i]);
+      connected++;
+    }
+  }
+  freeaddrinfo(res);
+  uint64_t t1 = now_ns();
+  printf("connected %d sockets in %.1f ms\n", o->conns, (t1 - t0) / 1e6);
+  fflush(stdout);
+
+  // the server may accept connections well after the handshake finished,
+  // so publish empty messages until every other connection has seen one.
+  // otherwise late joiners would miss the first messages of the run
+  int synced = 1;
+  uint64_t sync_deadline = now_ns() + 30000000000ULL;
+  while (synced < o->conns) {
+    if (now_ns() > sync_deadline) {
+      fprintf(stderr, "only %d of %d connections joined %s\n", synced,
+              o->conns, o->channel);
+      return -1;
+    }
+    bench_queue(&conns[0], FRAME_MSG, payload, 1 + chan_len);
+    bench_flush(&conns[0]);
+    if (poll(pfds, o->conns, 50) == -1) {
+      perror("poll");
+      return -1;
+    }
+    for (int i = 1; i < o->conns; ++i) {
+      if (!(pfds[i].revents & POLLIN)) continue;
+      struct bench_conn *c = &conns[i];
+      if (bench_fill(c) <= 0) continue;
+      struct frame f;
+      while (frame_reader_next(&c->reader, &f) == 1) {
+        if (f.type == FRAME_PING) {
+          bench_pong(c);
+          continue;
+        }
+        if (!bench_on_channel(o, &f, NULL, NULL)) continue;
+        if (!c->synced) {
+          c->synced = 1;
+          synced++;
+        }
+      }
+    }
+  }
+  uint64_t t2 = now_ns();
+  printf("all joined %s after %.1f ms\n", o->channel, (t2 - t1) / 1e6);
+  fflush(stdout);
+
+  uint64_t start = now_ns();
+  uint64_t send_until = start + (uint64_t)(o->seconds * 1e9);
+  uint64_t last_rx = send_until;
+  double total_rate = o->rate * o->publishers;
+  uint64_t sent = 0, received = 0, bytes_in = 0, send_errors = 0;
+  int next_pub = 0;
+
+  for (;;) {
+    uint64_t now = now_ns();
+    // after sending stops, drain until the server has been quiet for 500ms
+    if (now >= send_until && now - last_rx > 500000000ULL) break;
+    if (now < send_until) {
+      uint64_t due = (uint64_t)((now - start) / 1e9 * total_rate) + 1;
+      for (; sent < due; ++sent) {
+        struct bench_conn *c = &conns[next_pub];
+        next_pub = (next_pub + 1) % o->publishers;
+        uint64_t ts = now_ns();
+        memcpy(stamp, &ts, o->size < 8 ? o->size : 8);
+        if (bench_queue(c, FRAME_MSG, payload, payload_len) == -1) {
+          send_errors++;
+        }
+      }
+      for (int i = 0; i < o->publishers; ++i) {
+        if (bench_flush(&conns[i]) == -1) send_errors++;
+        pfds[i].events = conns[i].out_len && conns[i].shm.pair == NULL
+                             ? POLLIN | POLLOUT
+                             : POLLIN;
+      }
+    }
+    if (poll(pfds, o->conns, 1) == -1) {
+      perror("poll");
+      return -1;
+    }
+    now = now_ns();
+    for (int i = 0; i < o->conns; ++i) {
+      if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+      struct bench_conn *c = &conns[i];
+      ssize_t n = bench_fill(c);
+      if (n <= 0) {
+        if (n == -1 && errno == EAGAIN) continue;
+        fprintf(stderr, "connection %d lost\n", i);
+        pfds[i].fd = -1;
+        continue;
+      }
+      bytes_in += n;
+      struct frame f;
+      while (frame_reader_next(&c->reader, &f) == 1) {
+        const char *text;
+        size_t tlen;
+        if (f.type == FRAME_PING) {
+          bench_pong(c);
+          continue;
+        }
+        if (!bench_on_channel(o, &f, &text, &tlen) ||
+            tlen < sizeof(uint64_t)) {
+          continue;
+        }
+        uint64_t ts;
+        memcpy(&ts, text, sizeof(ts));
+        hist_record(hist, now - ts);
+        received++;
+        last_rx = now;
+      }
+    }
+  }
+
+  double secs = (send_until - start) / 1e9;
+  // the drain runs past the send window, receive rates cover both
+  double rx_secs = (last_rx - start) / 1e9;
+  uint64_t expected = sent * (o->conns - 1);
+  printf("sent %llu msgs (%.0f msg/s), received %llu of %llu copies "
+         "(%.0f msg/s, %.1f MB/s), %llu send errors\n",
+         (unsigned long long)sent, sent / secs, (unsigned long long)received,
+         (unsigned long long)expected, received / rx_secs,
+         bytes_in / rx_secs / 1e6, (unsigned long long)send_errors);
+  if (hist->total > 0) {
+    printf("latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p999 %.1f "
+           "max %.1f\n",
+           hist->min / 1e3, hist_quantile(hist, 0.5) / 1e3,
+           hist_quantile(hist, 0.9) / 1e3, hist_quantile(hist, 0.99) / 1e3,
+           hist_quantile(hist, 0.999) / 1e3, hist->max / 1e3);
+  }
+
+  for (int i = 0; i < o->conns; ++i) {
+    if (conns[i].shm.pair != NULL) {
+      shm_link_close(&conns[i].shm);
+    } else {
+      close(conns[i].fd);
+    }
+    frame_reader_free(&conns[i].reader);
+    free(conns[i].out);
+  }
+  free(conns);
+  free(pfds);
+  free(hist);
+  free(payload);
+  return 0;
+}
+
+/*
+ * expands PackBits data, see cpp/chip8/spectator.hpp
+ * return the number of bytes produced, -1 if in is malformed
+ */
+ssize_t unpackbits(const uint8_t *in, size_t len, uint8_t *out, size_t cap) {
+  size_t n = 0;
+  size_t i = 0;
+  while (i < len) {
+    uint8_t ctl = in[i++];
+    if (ctl < 128) {
+      size_t count = ctl + 1;
+      if (i + count > len || n + count > cap) return -1;
+      memcpy(out + n, in + i, count);
+      i += count;
+      n += count;
+    } else {
+      size_t count = 257 - ctl;
+      if (i >= len || n + count > cap) return -1;
+      memset(out + n, in[i++], count);
+      n += count;
+    }
+  }
+  return n;
+}
+
+#define VIDEO_ROWS 32
+
+/*
+ * draws 64x32 pixels as 16 terminal lines of half blocks
+ */
+void draw_screen(const uint64_t rows[VIDEO_ROWS], uint32_t seq,
+                 uint64_t bytes) {
+  static const char *cells[4] = {" ", "\u2580", "\u2584", "\u2588"};
+  printf("\x1b[H");
+  for (int r = 0; r < VIDEO_ROWS; r += 2) {
+    for (int col = 63; col >= 0; --col) {
+      int top = (rows[r] >> col) & 1;
+      int bottom = (rows[r + 1] >> col) & 1;
+      fputs(cells[top | bottom << 1], stdout);
+    }
+    putchar('\n');
+  }
+  printf("frame %u, %llu bytes received\x1b[K\n", seq,
+         (unsigned long long)bytes);
+  fflush(stdout);
+}
+
+/*
+ * watches a chip8 emulator streaming on channel. typed hex digits are sent
+ * to the emulator as key presses released 100ms later
+ */
+int watch(const char *host, const char *port, const char *channel) {
+  char input[CHANNEL_NAME_MAX + 1];
+  if (snprintf(input, sizeof(input), "%s/input", channel) >=
+      (int)sizeof(input)) {
+    fprintf(stderr, "channel name too long\n");
+    return -1;
+  }
+  int sockfd = connect_to(host, port);
+  struct frame_reader reader;
+  if (frame_reader_init(&reader, FRAME_READER_INITIAL) == -1 ||
+      frame_send(sockfd, FRAME_LEAVE, "", 0) == -1 ||
+      frame_send(sockfd, FRAME_JOIN, channel, strlen(channel)) == -1) {
+    perror("watch");
+    return -1;
+  }
+
+  uint64_t rows[VIDEO_ROWS] = {0};
+  uint64_t release_at[16] = {0};
+  uint64_t bytes = 0;
+  int have_keyframe = 0;
+  char *line = NULL;
+  size_t line_cap = 0;
+  printf("\x1b[2J");
+
+  struct pollfd pfds[2] = {{.fd = 0, .events = POLLIN},
+                           {.fd = sockfd, .events = POLLIN}};
+  for (;;) {
+    uint64_t now = now_ns();
+    int timeout = -1;
+    for (int key = 0; key < 16; ++key) {
+      if (release_at[key] == 0) continue;
+      if (release_at[key] <= now) {
+        uint8_t event[2] = {(uint8_t)key, 0};
+        frame_send_msg(sockfd, input, event, sizeof(event));
+        release_at[key] = 0;
+        continue;
+      }
+      int ms = (int)((release_at[key] - now) / 1000000) + 1;
+      if (timeout == -1 || ms < timeout) timeout = ms;
+    }
+    if (poll(pfds, 2, timeout) == -1) {
+      perror("poll");
+      return -1;
+    }
+    if (pfds[0].revents & POLLIN) {
+      ssize_t len = mgetline(&line, &line_cap);
+      if (len == -1) break;
+      for (ssize_t i = 0; i < len; ++i) {
+        char digit[2] = {line[i], '\0'};
+        char *end;
+        long key = strtol(digit, &end, 16);
+        if (*end != '\0') continue;
+        uint8_t event[2] = {(uint8_t)key, 1};
+        frame_send_msg(sockfd, input, event, sizeof(event));
+        release_at[key] = now_ns() + 100000000ULL;
+      }
+    }
+    if (!(pfds[1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+    ssize_t nbytes = frame_reader_fill(&reader, sockfd);
+    if (nbytes <= 0) {
+      fprintf(stderr, "server closed the connection\n");
+      break;
+    }
+    bytes += nbytes;
+    struct frame f;
+    while (frame_reader_next(&reader, &f) == 1) {
+      const char *chan, *text;
+      size_t chan_len, text_len;
+      if (f.type == FRAME_PING) {
+        frame_send(sockfd, FRAME_PONG, "", 0);
+        continue;
+      }
+      if (f.type != FRAME_MSG ||
+          frame_msg_split(&f, &chan, &chan_len, &text, &text_len) == -1 ||
+          chan_len != strlen(channel) || memcmp(chan, channel, chan_len) ||
+          text_len < 9) {
+        continue;
+      }
+      const uint8_t *body = (const uint8_t *)text;
+      uint32_t seq, mask;
+      memcpy(&seq, body + 1, sizeof(seq));  // little endian hosts only
+      memcpy(&mask, body + 5, sizeof(mask));
+      if (body[0] == 0) have_keyframe = 1;
+      if (!have_keyframe) continue;  // wait for a complete picture
+
+      uint8_t changed[VIDEO_ROWS * 8];
+      ssize_t n = unpackbits(body + 9, text_len - 9, changed, sizeof(changed));
+      if (n != __builtin_popcount(mask) * 8) continue;
+      const uint8_t *p = changed;
+      for (int r = 0; r < VIDEO_ROWS; ++r) {
+        if (!(mask & (1u << r))) continue;
+        uint64_t row = 0;
+        for (int b = 0; b < 8; ++b) row = row << 8 | *p++;
+        rows[r] = row;
+      }
+      draw_screen(rows, seq, bytes);
+    }
+  }
+  free(line);
+  frame_reader_free(&reader);
+  close(sockfd);
+  return 0;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s host port\n"
+          "       %s -u shm_socket\n"
+          "       %s -b [-c conns] [-p publishers] [-r rate] [-s size] "
+          "[-d seconds] [-C channel] [-u shm_socket] host port\n"
+          "       %s -w channel host port\n",
+          prog, prog, prog, prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  struct bench_opts o = {
+      .conns = 1000,
+      .publishers = 1,
+      .rate = 100,
+      .size = 64,
+      .seconds = 10,
+      .channel = "bench",
+  };
+  int benchmark = 0;
+  const char *watch_channel = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "bc:p:r:s:d:C:w:u:")) != -1) {
+    switch (opt) {
+      case 'u':
+        o.shm_path = optarg;
+        break;
+      case 'w':
+        watch_channel = optarg;
+        break;
+      case 'b':
+        benchmark = 1;
+        break;
+      case 'c':
+        o.conns = atoi(optarg);
+        break;
+      case 'p':
+        o.publishers = atoi(optarg);
+        break;
+      case 'r':
+        o.rate = atof(optarg);
+        break;
+      case 's':
+        o.size = atoi(optarg);
+        break;
+      case 'd':
+        o.seconds = atof(optarg);
+        break;
+      case 'C':
+        o.channel = optarg;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (!benchmark && watch_channel == NULL && o.shm_path != NULL) {
+    if (argc != optind) usage(argv[0]);
+    return chat(NULL, NULL, o.shm_path);
+  }
+  if (argc - optind != 2) usage(argv[0]);
+  if (watch_channel != NULL) {
+    return watch(argv[optind], argv[optind + 1], watch_channel) == -1
+               ? EXIT_FAILURE
+               : 0;
+  }
+  if (!benchmark) {
+    return chat(argv[optind], argv[optind + 1], NULL);
+  }
+  if (o.conns < 2 || o.publishers < 1 || o.publishers > o.conns ||
+      o.rate <= 0 || o.size < (int)sizeof(uint64_t) || o.seconds <= 0 ||
+      strlen(o.channel) > CHANNEL_NAME_MAX) {
+    fprintf(stderr, "invalid benchmark settings\n");
+    return EXIT_FAILURE;
+  }
+  return bench(argv[optind], argv[optind + 1], &o) == -1 ? EXIT_FAILURE : 0;
+}
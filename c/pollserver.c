@@ -1,16 +1,327 @@
+#define _GNU_SOURCE  // IOV_MAX
+
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "frame.h"
+#include "msglog.h"
+#include "shm_ring.h"
+
 #define PORT "9034"  // port client will connect to
-#define BACKLOG 10   // maximum number of connection that can be queued
+#define BACKLOG SOMAXCONN  // default listen backlog, -b overrides
+#define MSGBUF_SMALL 512             // msgbufs up to this size are pooled
+#define WQ_MAX_BYTES (8u << 20)      // drop clients that fall this far behind
+#define CONN_SLAB 64                 // connections allocated per slab chunk
+#define CONN_MAX_FDS (1 << 20)       // upper bound on the fd indexed table
+#define READER_KEEP (64u << 10)      // larger read buffers are not recycled
+#define WQ_KEEP 1024                 // longer write queues are freed when empty
+#define CONN_MAX_CHANNELS 64         // channels a single connection may join
+#define METRICS_PATH "/tmp/pollserver.sock"  // default metrics socket
+#define SHM_PATH "/tmp/pollserver.ring"      // default shared memory socket
+#define LOOP_BUCKETS 6               // loop latency buckets, 10us to +Inf
+#define WHEEL_SLOTS 512              // timing wheel slots, a power of two
+#define WHEEL_TICK_MS 100            // timing wheel resolution
+#define IDLE_SECONDS 30              // silence before a client is pinged
+#define PONG_TIMEOUT_MS 10000        // how long a pinged client may stay quiet
+#define LINGER_TIMEOUT_MS 5000       // bound on a deferred close
+#define HISTORY_LEN 32               // messages kept per channel for joiners
+#define HISTORY_MAX_BYTES (64 << 10) // bytes of history kept per channel
+#define ACCEPT_BATCH 256             // accepts per wakeup before serving others
+#define ADMIT_SLOTS 4096             // source addresses tracked, a power of two
+#define ADMIT_PROBE 8                // slots searched per source address
+#define ADMIT_RATE 50                // connections per second per address
+#define ADMIT_BURST 100              // connections a quiet address may open
+#define LOG_RING 4096                // events buffered until the loop idles
+#define MSGLOG_WINDOW_MS 10          // default durability window of the log
+
+/*
+ * an encoded frame, shared by every connection it is queued on and freed
+ * when the last of them has written it out
+ */
+struct msgbuf {
+  int refs;
+  size_t len;
+  struct msgbuf *next_free;  // link in the small buffer pool
+  char data[];
+};
+
+/*
+ * a msgbuf queued for writing, off is how much of it was already sent
+ */
+struct wq_entry {
+  struct msgbuf *mb;
+  size_t off;
+};
+
+/*
+ * traffic seen on a connection
+ */
+struct conn_stats {
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t msgs_in;
+  uint64_t msgs_out;
+};
+
+struct channel;
+
+/*
+ * a timer on the timing wheel, an intrusive list node so arming and
+ * cancelling are O(1). expires is an absolute wheel tick
+ */
+struct timer {
+  struct timer *next;
+  struct timer *prev;
+  uint64_t expires;
+};
+
+/*
+ * hashed timing wheel. a timer lives in slot expires % WHEEL_SLOTS, timers
+ * further out than one revolution simply stay in their slot until their
+ * tick comes around, so any deadline costs the same to arm
+ */
+struct timer_wheel {
+  struct timer slots[WHEEL_SLOTS];  // list heads
+  uint64_t start_ns;
+  uint64_t now_tick;  // last tick processed
+  size_t armed;
+};
+
+enum timer_kind {
+  TIMER_IDLE,    // check whether the client went quiet
+  TIMER_PONG,    // a ping is out, close unless the client answers
+  TIMER_LINGER,  // give a deferred close a bounded time to flush
+};
+
+/*
+ * one channel a connection is subscribed to, slot is the position of the
+ * connection in the subscriber array of the channel
+ */
+struct membership {
+  struct channel *ch;
+  int slot;
+};
+
+/*
+ * per connection state. conns are carved out of slabs and recycled through
+ * the free list together with their buffers, so a connect/disconnect storm
+ * does not touch the allocator.
+ */
+enum conn_kind {
+  CONN_CLIENT,   // framed chat protocol
+  CONN_METRICS,  // one line request on the metrics socket
+};
+
+struct conn {
+  int fd;
+  int idx;               // slot of the connection in pfds
+  int kind;
+  int closing;           // queued for close at the end of the tick
+  int linger;            // close once the write queue is drained
+  int dirty;             // on the flush list
+  int timer_kind;
+  struct timer timer;
+  uint64_t last_rx;      // wheel tick of the last frame received
+  uint64_t ping_tick;    // wheel tick the outstanding ping was sent
+  struct conn *next;     // free list or close list link
+  struct conn *next_flush;
+  struct conn_stats stats;
+  struct membership *chans;  // channels joined, kept across slab reuse
+  int nchans;
+  struct frame_reader reader;
+  struct wq_entry *wq;  // ring of pending writes, wq_cap is a power of two
+  size_t wq_cap;
+  size_t wq_head;
+  size_t wq_len;
+  size_t wq_bytes;
+  struct shm_link shm;  // pair is NULL unless the client is on this host
+};
+
+/*
+ * all live connections. by_fd maps a descriptor to its conn in O(1) and
+ * pfds is the dense array handed to poll, pfds[0] being the listener.
+ * both are sized from RLIMIT_NOFILE up front and never reallocated.
+ */
+struct conn_table {
+  struct conn **by_fd;
+  struct pollfd *pfds;
+  int fd_count;
+  int fd_size;
+  struct conn *free_list;
+  struct conn *close_list;
+  struct conn *flush_list;
+  struct timer_wheel wheel;  // per connection timers
+  uint64_t idle_ticks;       // silence before a ping, 0 disables heartbeats
+  struct msgbuf *ping;       // shared FRAME_PING
+};
+
+/*
+ * server wide counters. they are plain relaxed atomics so any thread can
+ * bump or read them without locks, a snapshot is served on the metrics
+ * socket by the event loop itself
+ */
+struct metrics {
+  _Atomic uint64_t connections;  // gauge
+  _Atomic uint64_t accepts;
+  _Atomic uint64_t admission_rejects;
+  _Atomic uint64_t open_failures;  // accepted but no room in the conn table
+  _Atomic uint64_t shm_accepts;
+  _Atomic uint64_t disconnects;
+  _Atomic uint64_t bytes_in;
+  _Atomic uint64_t bytes_out;
+  _Atomic uint64_t msgs_in;
+  _Atomic uint64_t msgs_fanned_out;
+  _Atomic uint64_t send_errors;
+  _Atomic uint64_t recv_errors;
+  _Atomic uint64_t protocol_errors;  // malformed frames and refused joins
+  _Atomic uint64_t slow_consumer_drops;
+  _Atomic uint64_t queued_bytes;      // gauge, bytes waiting in write queues
+  _Atomic uint64_t queued_bytes_max;  // deepest single write queue seen
+  _Atomic uint64_t channels;          // gauge
+  _Atomic uint64_t pings_sent;
+  _Atomic uint64_t idle_timeouts;
+  _Atomic uint64_t history_replayed;
+  _Atomic uint64_t loop_iterations;
+  _Atomic uint64_t loop_ns_sum;
+  _Atomic uint64_t loop_ns_max;
+  _Atomic uint64_t loop_ns_le[LOOP_BUCKETS];  // cumulative histogram
+};
+
+#define METRIC_ADD(name, n) \
+  atomic_fetch_add_explicit(&metrics.name, (n), memory_order_relaxed)
+#define METRIC_SUB(name, n) \
+  atomic_fetch_sub_explicit(&metrics.name, (n), memory_order_relaxed)
+#define METRIC_GET(name) \
+  atomic_load_explicit(&metrics.name, memory_order_relaxed)
+#define METRIC_MAX(name, v)                                         \
+  do {                                                              \
+    uint64_t v_ = (v);                                              \
+    if (v_ > METRIC_GET(name))                                      \
+      atomic_store_explicit(&metrics.name, v_, memory_order_relaxed); \
+  } while (0)
+
+static struct metrics metrics;
+static const uint64_t loop_bucket_ns[LOOP_BUCKETS - 1] = {
+    10000, 100000, 1000000, 10000000, 100000000};
+
+/*
+ * a subscriber of a channel, slot is the position of the channel in the
+ * membership array of the connection, so either side can be removed in O(1)
+ */
+struct sub {
+  struct conn *c;
+  int slot;
+};
+
+/*
+ * a named channel, subs is a dense array so fan-out is a linear walk over
+ * exactly the connections that joined
+ */
+struct channel {
+  uint64_t hash;
+  uint8_t name_len;
+  char name[CHANNEL_NAME_MAX];
+  struct sub *subs;
+  int nsubs;
+  int subs_cap;
+  // the last messages published, holding a reference to the same msgbufs
+  // the subscribers were sent. the ring lives inside the channel so keeping
+  // history never allocates
+  struct msgbuf *history[HISTORY_LEN];
+  // the same messages as FRAME_HISTORY, built on their first replay and
+  // shared by every later joiner
+  struct msgbuf *replay[HISTORY_LEN];
+  int hist_head;  // oldest entry
+  int hist_len;
+  size_t hist_bytes;
+};
+
+/*
+ * open addressing index from channel name to channel, cap is a power of two
+ */
+struct channel_table {
+  struct channel **slots;
+  size_t cap;
+  size_t count;
+  int history_len;  // messages replayed to joiners, at most HISTORY_LEN
+};
+
+/*
+ * token bucket of one source address, tokens are counted in thousandths so
+ * refilling needs no floating point
+ */
+struct admit_bucket {
+  uint8_t addr[16];  // IPv4 addresses are stored v4 mapped
+  uint64_t last_ns;  // last refill, 0 marks a free entry
+  uint64_t tokens;
+};
+
+/*
+ * fixed size table of buckets. an address probes ADMIT_PROBE slots from its
+ * hash and takes over the stalest one if none matches, so a flood of
+ * distinct sources can only make the limiter forget, never grow
+ */
+struct admission {
+  struct admit_bucket slots[ADMIT_SLOTS];
+  uint64_t rate;  // 0 admits everyone
+  uint64_t burst;
+};
+
+enum log_kind {
+  LOG_CONNECT,
+  LOG_HANGUP,
+  LOG_REJECT,
+  LOG_SHM_CONNECT,
+  LOG_OPEN_FAILED,
+  LOG_SLOW_CONSUMER,
+  LOG_RECV_FAILED,
+  LOG_BAD_FRAME,
+  LOG_JOIN_FAILED,
+};
+
+/*
+ * a connection event, recorded in binary and formatted later
+ */
+struct log_entry {
+  uint8_t kind;
+  uint8_t family;  // AF_UNSPEC if there is no address
+  int fd;
+  int err;  // errno when the event was recorded
+  uint8_t addr[16];
+};
+
+/*
+ * events are appended here during a tick and only turned into text once
+ * the tick's work is done, so inet_ntop and stdio never delay traffic
+ */
+struct log_ring {
+  struct log_entry entries[LOG_RING];
+  size_t head;
+  size_t len;
+  uint64_t dropped;
+};
+
+static struct msgbuf *msgbuf_pool;
+static struct admission admission = {.rate = ADMIT_RATE,
+                                     .burst = ADMIT_BURST};
+static struct log_ring log_ring;
+static struct msglog msglog;  // ring is NULL unless -L was given
 
 /*
  * fetches the ip address info from a sockaddr struct
@@ -18,17 +329,36 @@
  */
 void *get_in_addr(struct sockaddr *sa) {
   if (sa->sa_family == AF_INET) {
-    return &((struct sockaddr_in *)&sa)->sin_addr;
+    return &((struct sockaddr_in *)sa)->sin_addr;
   } else {
-    return &((struct sockaddr_in6 *)&sa)->sin6_addr;
+    return &((struct sockaddr_in6 *)sa)->sin6_addr;
   }
 }
 
 /*
- * fetches a socket listening on the port PORT,
+ * records a connection event for log_flush, sa may be NULL
+ */
+void log_event(uint8_t kind, int fd, struct sockaddr *sa) {
+  if (log_ring.len == LOG_RING) {
+    log_ring.dropped++;
+    return;
+  }
+  struct log_entry *e =
+      &log_ring.entries[(log_ring.head + log_ring.len++) % LOG_RING];
+  e->kind = kind;
+  e->fd = fd;
+  e->err = errno;
+  e->family = sa ? sa->sa_family : AF_UNSPEC;
+  if (sa != NULL) {
+    memcpy(e->addr, get_in_addr(sa), sa->sa_family == AF_INET ? 4 : 16);
+  }
+}
+
+/*
+ * fetches a non blocking socket listening on the port PORT,
  * return -1 on error
  */
-int get_listener() {
+int get_listener(int backlog) {
   int sockfd;
   int yes = 1;
   int rv;
@@ -44,7 +374,8 @@ int get_listener() {
     return -1;
   }
   for (p = res; p != NULL; p = p->ai_next) {
-    sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    p->ai_protocol);
     if (sockfd < 0) continue;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
     if (bind(sockfd, p->ai_addr, p->ai_addrlen) < 0) {
@@ -57,100 +388,1265 @@ int get_listener() {
   if (p == NULL) {
     return -1;
   }
-  if (listen(sockfd, BACKLOG) < 0) {
+  if (listen(sockfd, backlog) < 0) {
     return -1;
   }
   return sockfd;
 }
 
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * allocates a msgbuf able to hold len bytes with a single reference,
+ * small buffers are recycled through msgbuf_pool
+ * return NULL on allocation failure
+ */
+struct msgbuf *msgbuf_new(size_t len) {
+  struct msgbuf *mb;
+  if (len <= MSGBUF_SMALL && msgbuf_pool != NULL) {
+    mb = msgbuf_pool;
+    msgbuf_pool = mb->next_free;
+  } else {
+    mb = malloc(sizeof(*mb) + (len <= MSGBUF_SMALL ? MSGBUF_SMALL : len));
+    if (mb == NULL) return NULL;
+  }
+  mb->refs = 1;
+  mb->len = len;
+  mb->next_free = NULL;
+  return mb;
+}
+
+/*
+ * drops a reference to mb, releasing it once nobody holds it
+ */
+void msgbuf_put(struct msgbuf *mb) {
+  if (--mb->refs > 0) return;
+  if (mb->len <= MSGBUF_SMALL) {
+    mb->next_free = msgbuf_pool;
+    msgbuf_pool = mb;
+  } else {
+    free(mb);
+  }
+}
+
+/*
+ * encodes a frame into a fresh msgbuf
+ * return NULL on allocation failure
+ */
+struct msgbuf *msgbuf_frame(uint8_t type, const void *data, size_t len) {
+  uint8_t hdr[FRAME_MAX_HEADER];
+  size_t hlen = frame_header_encode(type, len, hdr);
+  struct msgbuf *mb = msgbuf_new(hlen + len);
+  if (mb == NULL) return NULL;
+  memcpy(mb->data, hdr, hlen);
+  memcpy(mb->data + hlen, data, len);
+  return mb;
+}
+
+/*
+ * copies the encoded frame in mb with its type replaced
+ * return NULL on allocation failure
+ */
+struct msgbuf *msgbuf_retype(const struct msgbuf *mb, uint8_t type) {
+  uint64_t len;
+  int hlen = varint_decode((const uint8_t *)mb->data, mb->len, &len);
+  struct msgbuf *copy = msgbuf_new(mb->len);
+  if (copy == NULL) return NULL;
+  memcpy(copy->data, mb->data, mb->len);
+  copy->data[hlen] = type;
+  return copy;
+}
+
+void timer_wheel_init(struct timer_wheel *w, uint64_t now_ns) {
+  for (int i = 0; i < WHEEL_SLOTS; ++i) {
+    w->slots[i].next = w->slots[i].prev = &w->slots[i];
+  }
+  w->start_ns = now_ns;
+  w->now_tick = 0;
+  w->armed = 0;
+}
+
+uint64_t ms_to_ticks(uint64_t ms) {
+  return (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+}
+
+void timer_list_unlink(struct timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+void timer_list_push(struct timer *head, struct timer *t) {
+  t->next = head->next;
+  t->prev = head;
+  head->next->prev = t;
+  head->next = t;
+}
+
+void timer_cancel(struct timer_wheel *w, struct timer *t) {
+  if (t->next == NULL) return;
+  timer_list_unlink(t);
+  w->armed--;
+}
+
+/*
+ * (re)arms t to fire on the absolute tick expires, at the earliest on the
+ * next tick
+ */
+void timer_arm(struct timer_wheel *w, struct timer *t, uint64_t expires) {
+  timer_cancel(w, t);
+  t->expires = expires > w->now_tick ? expires : w->now_tick + 1;
+  timer_list_push(&w->slots[t->expires & (WHEEL_SLOTS - 1)], t);
+  w->armed++;
+}
+
+/*
+ * return the poll timeout in ms until the next tick is due, -1 if no timer
+ * is armed
+ */
+int timer_wheel_timeout(const struct timer_wheel *w, uint64_t now_ns) {
+  if (w->armed == 0) return -1;
+  uint64_t next = w->start_ns + (w->now_tick + 1) * WHEEL_TICK_MS * 1000000;
+  if (next <= now_ns) return 0;
+  return (int)((next - now_ns + 999999) / 1000000);
+}
+
+/*
+ * advances the wheel to now_ns and moves every expired timer to fired, a
+ * list head owned by the caller. when the loop fell behind by a whole
+ * revolution each slot is visited once
+ */
+void timer_wheel_advance(struct timer_wheel *w, uint64_t now_ns,
+                         struct timer *fired) {
+  fired->next = fired->prev = fired;
+  uint64_t tick = (now_ns - w->start_ns) / (WHEEL_TICK_MS * 1000000ULL);
+  if (tick <= w->now_tick) return;
+  uint64_t steps = tick - w->now_tick;
+  if (steps > WHEEL_SLOTS) steps = WHEEL_SLOTS;
+  for (uint64_t i = 1; i <= steps; ++i) {
+    struct timer *head = &w->slots[(w->now_tick + i) & (WHEEL_SLOTS - 1)];
+    for (struct timer *t = head->next, *next; t != head; t = next) {
+      next = t->next;
+      if (t->expires <= tick) {
+        timer_list_unlink(t);
+        w->armed--;
+        timer_list_push(fired, t);
+      }
+    }
+  }
+  w->now_tick = tick;
+}
+
+/*
+ * puts c on the list of connections to flush at the end of the tick
+ */
+void conn_mark_dirty(struct conn_table *t, struct conn *c) {
+  if (c->dirty) return;
+  c->dirty = 1;
+  c->next_flush = t->flush_list;
+  t->flush_list = c;
+}
+
+/*
+ * frees the write queue of c if it is empty and grew past WQ_KEEP, so one
+ * burst does not pin a large ring for the life of the connection or of
+ * whoever reuses its slot
+ */
+void conn_wq_trim(struct conn *c) {
+  if (c->wq_len > 0 || c->wq_cap <= WQ_KEEP) return;
+  free(c->wq);
+  c->wq = NULL;
+  c->wq_cap = 0;
+  c->wq_head = 0;
+}
+
+/*
+ * queues mb on c, taking a new reference to it.
+ * nothing is written until conn_flush runs at the end of the loop tick
+ * return -1 if the queue could not grow or the client is too far behind
+ */
+int conn_enqueue(struct conn_table *t, struct conn *c, struct msgbuf *mb) {
+  if (c->wq_bytes + mb->len > WQ_MAX_BYTES) return -1;
+  if (c->wq_len == c->wq_cap) {
+    size_t cap = c->wq_cap ? c->wq_cap * 2 : 16;
+    struct wq_entry *wq = malloc(sizeof(*wq) * cap);
+    if (wq == NULL) return -1;
+    for (size_t i = 0; i < c->wq_len; ++i) {
+      wq[i] = c->wq[(c->wq_head + i) & (c->wq_cap - 1)];
+    }
+    free(c->wq);
+    c->wq = wq;
+    c->wq_cap = cap;
+    c->wq_head = 0;
+  }
+  c->wq[(c->wq_head + c->wq_len) & (c->wq_cap - 1)] =
+      (struct wq_entry){mb, 0};
+  c->wq_len++;
+  c->wq_bytes += mb->len;
+  c->stats.msgs_out++;
+  METRIC_ADD(queued_bytes, mb->len);
+  METRIC_MAX(queued_bytes_max, c->wq_bytes);
+  mb->refs++;
+  conn_mark_dirty(t, c);
+  return 0;
+}
+
+/*
+ * writes as much of the queue of c as the socket takes with one writev
+ * return 1 if data is still pending, 0 if the queue is empty, -1 on error
+ */
+int conn_flush(struct conn *c) {
+  struct iovec iov[IOV_MAX];
+  int cnt = 0;
+  for (size_t i = 0; i < c->wq_len && cnt < IOV_MAX; ++i, ++cnt) {
+    struct wq_entry *e = &c->wq[(c->wq_head + i) & (c->wq_cap - 1)];
+    iov[cnt].iov_base = e->mb->data + e->off;
+    iov[cnt].iov_len = e->mb->len - e->off;
+  }
+  if (cnt == 0) return 0;
+  ssize_t nbytes = c->shm.pair ? shm_link_writev(&c->shm, iov, cnt)
+                               : writev(c->fd, iov, cnt);
+  if (nbytes == -1) {
+    return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 1
+                                                                        : -1;
+  }
+  c->wq_bytes -= nbytes;
+  c->stats.bytes_out += nbytes;
+  METRIC_SUB(queued_bytes, nbytes);
+  METRIC_ADD(bytes_out, nbytes);
+  while (nbytes > 0) {
+    struct wq_entry *e = &c->wq[c->wq_head];
+    size_t left = e->mb->len - e->off;
+    if ((size_t)nbytes < left) {
+      e->off += nbytes;
+      break;
+    }
+    nbytes -= left;
+    msgbuf_put(e->mb);
+    c->wq_head = (c->wq_head + 1) & (c->wq_cap - 1);
+    c->wq_len--;
+  }
+  conn_wq_trim(c);
+  return c->wq_len > 0;
+}
+
+/*
+ * FNV-1a over a channel name
+ */
+uint64_t channel_hash(const char *name, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h = (h ^ (uint8_t)name[i]) * 1099511628211ULL;
+  }
+  return h;
+}
+
+/*
+ * return 0 on success, -1 on allocation failure
+ */
+int channel_table_init(struct channel_table *t, size_t cap) {
+  t->slots = calloc(cap, sizeof(*t->slots));
+  t->cap = t->slots ? cap : 0;
+  t->count = 0;
+  t->history_len = HISTORY_LEN;
+  return t->slots ? 0 : -1;
+}
+
+/*
+ * return the slot holding the channel name, or the empty slot where it
+ * would be inserted
+ */
+size_t channel_slot(struct channel_table *t, uint64_t hash, const char *name,
+                    size_t len) {
+  size_t i = hash & (t->cap - 1);
+  while (t->slots[i] != NULL) {
+    struct channel *ch = t->slots[i];
+    if (ch->hash == hash && ch->name_len == len &&
+        memcmp(ch->name, name, len) == 0) {
+      break;
+    }
+    i = (i + 1) & (t->cap - 1);
+  }
+  return i;
+}
+
+/*
+ * looks up the channel name, creating it when create is set
+ * return NULL if it does not exist or could not be created
+ */
+struct channel *channel_get(struct channel_table *t, const char *name,
+                            size_t len, int create) {
+  if (len > CHANNEL_NAME_MAX) return NULL;
+  uint64_t hash = channel_hash(name, len);
+  size_t i = channel_slot(t, hash, name, len);
+  if (t->slots[i] != NULL || !create) return t->slots[i];
+
+  if ((t->count + 1) * 2 > t->cap) {  // keep the load factor under 1/2
+    struct channel_table grown;
+    if (channel_table_init(&grown, t->cap * 2) == -1) return NULL;
+    for (size_t j = 0; j < t->cap; ++j) {
+      struct channel *ch = t->slots[j];
+      if (ch != NULL) {
+        grown.slots[channel_slot(&grown, ch->hash, ch->name, ch->name_len)] =
+            ch;
+      }
+    }
+    grown.count = t->count;
+    grown.history_len = t->history_len;
+    free(t->slots);
+    *t = grown;
+    i = channel_slot(t, hash, name, len);
+  }
+  struct channel *ch = calloc(1, sizeof(*ch));
+  if (ch == NULL) return NULL;
+  ch->hash = hash;
+  ch->name_len = (uint8_t)len;
+  memcpy(ch->name, name, len);
+  t->slots[i] = ch;
+  t->count++;
+  METRIC_ADD(channels, 1);
+  return ch;
+}
+
+/*
+ * removes an empty channel from the index, shifting back the entries of
+ * its probe run so lookups never need tombstones
+ */
+void channel_delete(struct channel_table *t, struct channel *ch) {
+  size_t i = channel_slot(t, ch->hash, ch->name, ch->name_len);
+  size_t j = i;
+  for (;;) {
+    j = (j + 1) & (t->cap - 1);
+    if (t->slots[j] == NULL) break;
+    size_t home = t->slots[j]->hash & (t->cap - 1);
+    // move slots[j] into the hole unless its home lies in (i, j]
+    if ((i <= j) ? (home <= i || home > j) : (home <= i && home > j)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+  t->slots[i] = NULL;
+  t->count--;
+  METRIC_SUB(channels, 1);
+  for (int k = 0; k < ch->hist_len; ++k) {
+    int i = (ch->hist_head + k) % HISTORY_LEN;
+    msgbuf_put(ch->history[i]);
+    if (ch->replay[i] != NULL) msgbuf_put(ch->replay[i]);
+  }
+  free(ch->subs);
+  free(ch);
+}
+
+/*
+ * return the index of ch among the channels of c, -1 if c is not a member
+ */
+int channel_find(struct conn *c, struct channel *ch) {
+  for (int k = 0; k < c->nchans; ++k) {
+    if (c->chans[k].ch == ch) return k;
+  }
+  return -1;
+}
+
+/*
+ * subscribes c to ch, joining twice is a no-op
+ * return 1 if c joined, 0 if it already was a member and -1 if c joined
+ * too many channels or memory ran out
+ */
+int channel_join(struct channel *ch, struct conn *c) {
+  if (channel_find(c, ch) != -1) return 0;
+  if (c->nchans == CONN_MAX_CHANNELS) return -1;
+  if (c->chans == NULL) {
+    c->chans = malloc(sizeof(*c->chans) * CONN_MAX_CHANNELS);
+    if (c->chans == NULL) return -1;
+  }
+  if (ch->nsubs == ch->subs_cap) {
+    int cap = ch->subs_cap ? ch->subs_cap * 2 : 8;
+    struct sub *subs = realloc(ch->subs, sizeof(*subs) * cap);
+    if (subs == NULL) return -1;
+    ch->subs = subs;
+    ch->subs_cap = cap;
+  }
+  ch->subs[ch->nsubs] = (struct sub){c, c->nchans};
+  c->chans[c->nchans] = (struct membership){ch, ch->nsubs};
+  ch->nsubs++;
+  c->nchans++;
+  return 1;
+}
+
+/*
+ * keeps a reference to mb in the history of ch, evicting the oldest
+ * entries until both the message and the byte limit hold
+ */
+void channel_remember(struct channel_table *t, struct channel *ch,
+                      struct msgbuf *mb) {
+  if (t->history_len == 0 || mb->len > HISTORY_MAX_BYTES) return;
+  while (ch->hist_len > 0 && (ch->hist_len == t->history_len ||
+                              ch->hist_bytes + mb->len > HISTORY_MAX_BYTES)) {
+    struct msgbuf *old = ch->history[ch->hist_head];
+    ch->hist_bytes -= old->len;
+    msgbuf_put(old);
+    if (ch->replay[ch->hist_head] != NULL) {
+      msgbuf_put(ch->replay[ch->hist_head]);
+      ch->replay[ch->hist_head] = NULL;
+    }
+    ch->hist_head = (ch->hist_head + 1) % HISTORY_LEN;
+    ch->hist_len--;
+  }
+  mb->refs++;
+  ch->history[(ch->hist_head + ch->hist_len) % HISTORY_LEN] = mb;
+  ch->hist_len++;
+  ch->hist_bytes += mb->len;
+}
+
 /*
- * add new socket descriptor to the pfds.
- * it relallocs pfds if fd_count == fd_size
+ * drops the k-th membership of c. both arrays swap their last entry into
+ * the hole and fix up its back reference. empty channels are deleted,
+ * except for the lobby
  */
-void add_to_pfds(struct pollfd *pfds[], int new_fd, int *fd_count,
-                 int *fd_size) {
-  if (*fd_count == *fd_size) {
-    *fd_size *= 2;
-    *pfds = realloc(*pfds, sizeof(**pfds) * (*fd_size));
+void channel_leave(struct channel_table *t, struct conn *c, int k) {
+  struct channel *ch = c->chans[k].ch;
+  int slot = c->chans[k].slot;
+
+  struct sub last = ch->subs[--ch->nsubs];
+  ch->subs[slot] = last;
+  last.c->chans[last.slot].slot = slot;
+
+  struct membership moved = c->chans[--c->nchans];
+  c->chans[k] = moved;
+  if (k != c->nchans) {
+    moved.ch->subs[moved.slot].slot = k;
+  }
+
+  if (ch->nsubs == 0 && ch->name_len > 0) {
+    channel_delete(t, ch);
   }
-  (*pfds)[*fd_count].fd = new_fd;
-  (*pfds)[*fd_count].events = POLLIN;
-  (*fd_count)++;
 }
 
 /*
- * delete a entry from pfds at index i
+ * sizes the connection table for every descriptor the process may open
+ * return -1 on allocation failure
  */
-void del_from_pfds(struct pollfd pfds[], int i, int *fd_count) {
-  pfds[i] = pfds[*fd_count - 1];
-  (*fd_count)--;
+int conn_table_init(struct conn_table *t) {
+  struct rlimit rl;
+  int size = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    size = rl.rlim_cur < CONN_MAX_FDS ? (int)rl.rlim_cur : CONN_MAX_FDS;
+  } else if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+    size = CONN_MAX_FDS;
+  }
+  memset(t, 0, sizeof(*t));
+  t->by_fd = calloc(size, sizeof(*t->by_fd));
+  t->pfds = calloc(size, sizeof(*t->pfds));
+  t->ping = msgbuf_frame(FRAME_PING, NULL, 0);
+  if (t->by_fd == NULL || t->pfds == NULL || t->ping == NULL) return -1;
+  t->fd_size = size;
+  t->idle_ticks = ms_to_ticks(IDLE_SECONDS * 1000);
+  timer_wheel_init(&t->wheel, now_ns());
+  return 0;
 }
 
-int main() {
+/*
+ * refills the free list with a new slab of connections
+ * return -1 on allocation failure
+ */
+int conn_slab_grow(struct conn_table *t) {
+  struct conn *slab = calloc(CONN_SLAB, sizeof(*slab));
+  if (slab == NULL) return -1;
+  for (int i = 0; i < CONN_SLAB; ++i) {
+    slab[i].fd = -1;
+    slab[i].idx = -1;
+    slab[i].next = t->free_list;
+    t->free_list = &slab[i];
+  }
+  return 0;
+}
+
+/*
+ * closes c once everything queued on it was written, or after
+ * LINGER_TIMEOUT_MS if the peer stops reading
+ */
+void conn_linger(struct conn_table *t, struct conn *c) {
+  c->linger = 1;
+  c->timer_kind = TIMER_LINGER;
+  timer_arm(&t->wheel, &c->timer,
+            t->wheel.now_tick + ms_to_ticks(LINGER_TIMEOUT_MS));
+}
+
+/*
+ * takes a connection off the free list and registers fd with poll
+ * return NULL if the table is full or memory ran out
+ */
+struct conn *conn_open(struct conn_table *t, int fd, int kind) {
+  if (fd >= t->fd_size || t->fd_count == t->fd_size) return NULL;
+  if (t->free_list == NULL && conn_slab_grow(t) == -1) return NULL;
+  struct conn *c = t->free_list;
+  if (c->reader.buf == NULL &&
+      frame_reader_init(&c->reader, FRAME_READER_INITIAL) == -1) {
+    return NULL;
+  }
+  t->free_list = c->next;
+  c->next = NULL;
+  c->fd = fd;
+  c->kind = kind;
+  c->idx = t->fd_count++;
+  c->last_rx = t->wheel.now_tick;
+  if (kind == CONN_CLIENT) {
+    if (t->idle_ticks > 0) {
+      c->timer_kind = TIMER_IDLE;
+      timer_arm(&t->wheel, &c->timer, c->last_rx + t->idle_ticks);
+    }
+  } else {
+    // requests on side sockets must arrive and be answered promptly
+    c->timer_kind = TIMER_LINGER;
+    timer_arm(&t->wheel, &c->timer,
+              c->last_rx + ms_to_ticks(LINGER_TIMEOUT_MS));
+  }
+  memset(&c->stats, 0, sizeof(c->stats));
+  t->pfds[c->idx] = (struct pollfd){.fd = fd, .events = POLLIN};
+  t->by_fd[fd] = c;
+  return c;
+}
+
+/*
+ * schedules c to be closed once the current tick is over. the pfds slot is
+ * kept until then so the scan over pfds never sees entries move under it
+ */
+void conn_close(struct conn_table *t, struct conn *c) {
+  if (c->closing) return;
+  c->closing = 1;
+  c->next = t->close_list;
+  t->close_list = c;
+}
+
+/*
+ * closes every connection queued by conn_close and recycles its state
+ */
+void conn_reap(struct conn_table *t, struct channel_table *chans) {
+  while (t->close_list != NULL) {
+    struct conn *c = t->close_list;
+    t->close_list = c->next;
+    while (c->nchans > 0) {
+      channel_leave(chans, c, c->nchans - 1);
+    }
+
+    // swap the last pfds entry into the freed slot
+    int last = --t->fd_count;
+    if (c->idx != last) {
+      t->pfds[c->idx] = t->pfds[last];
+      t->by_fd[t->pfds[c->idx].fd]->idx = c->idx;
+    }
+    t->by_fd[c->fd] = NULL;
+    if (c->shm.pair != NULL) {
+      shm_link_close(&c->shm);  // c->fd is its wait_fd
+    } else {
+      close(c->fd);
+    }
+    timer_cancel(&t->wheel, &c->timer);
+
+    for (size_t i = 0; i < c->wq_len; ++i) {
+      msgbuf_put(c->wq[(c->wq_head + i) & (c->wq_cap - 1)].mb);
+    }
+    METRIC_SUB(queued_bytes, c->wq_bytes);
+    if (c->kind == CONN_CLIENT) {
+      METRIC_SUB(connections, 1);
+      METRIC_ADD(disconnects, 1);
+    }
+    c->wq_head = c->wq_len = c->wq_bytes = 0;
+    conn_wq_trim(c);
+    if (c->reader.cap > READER_KEEP) {
+      frame_reader_free(&c->reader);
+    }
+    c->reader.head = c->reader.tail = 0;
+    c->fd = -1;
+    c->idx = -1;
+    c->closing = 0;
+    c->linger = 0;
+    c->next = t->free_list;
+    t->free_list = c;
+  }
+}
+
+/*
+ * writes out everything queued during this tick, one writev per connection
+ */
+void conn_flush_all(struct conn_table *t) {
+  struct conn *c = t->flush_list;
+  t->flush_list = NULL;
+  while (c != NULL) {
+    struct conn *next = c->next_flush;
+    c->dirty = 0;
+    c->next_flush = NULL;
+    if (!c->closing) {
+      int rv = conn_flush(c);
+      if (rv == -1) {
+        METRIC_ADD(send_errors, 1);
+        conn_close(t, c);
+      } else if (rv == 0 && c->linger) {
+        conn_close(t, c);
+      } else {
+        // a full ring is reported by the client waking us, not by POLLOUT
+        t->pfds[c->idx].events =
+            rv && c->shm.pair == NULL ? POLLIN | POLLOUT : POLLIN;
+      }
+    }
+    c = next;
+  }
+}
+
+/*
+ * publishes the FRAME_MSG f from sender to every other subscriber of its
+ * channel, the frame is encoded once and shared by all of them
+ */
+void channel_publish(struct conn_table *t, struct channel_table *chans,
+                     struct conn *sender, const struct frame *f) {
+  const char *name, *text;
+  size_t name_len, text_len;
+  if (frame_msg_split(f, &name, &name_len, &text, &text_len) == -1) return;
+  struct channel *ch = channel_get(chans, name, name_len, 0);
+  if (ch == NULL) return;
+  struct msgbuf *mb = msgbuf_frame(f->type, f->data, f->len);
+  if (mb == NULL) {
+    perror("msgbuf_frame");
+    return;
+  }
+  for (int i = 0; i < ch->nsubs; ++i) {
+    struct conn *dest = ch->subs[i].c;
+    if (dest == sender || dest->closing) continue;
+    if (conn_enqueue(t, dest, mb) == -1) {
+      METRIC_ADD(slow_consumer_drops, 1);
+      log_event(LOG_SLOW_CONSUMER, dest->fd, NULL);
+      conn_close(t, dest);
+    } else {
+      METRIC_ADD(msgs_fanned_out, 1);
+    }
+  }
+  if (msglog.ring != NULL) msglog_append(&msglog, mb->data, mb->len);
+  channel_remember(chans, ch, mb);
+  msgbuf_put(mb);
+}
+
+/*
+ * queues the history of ch on c, which just joined. it goes out with the
+ * rest of the tick in a single writev, as FRAME_HISTORY so the client can
+ * tell it from what is published from now on
+ */
+void channel_replay(struct conn_table *t, struct channel *ch, struct conn *c) {
+  for (int k = 0; k < ch->hist_len; ++k) {
+    int i = (ch->hist_head + k) % HISTORY_LEN;
+    if (ch->replay[i] == NULL) {
+      ch->replay[i] = msgbuf_retype(ch->history[i], FRAME_HISTORY);
+    }
+    if (ch->replay[i] == NULL || conn_enqueue(t, c, ch->replay[i]) == -1) {
+      conn_close(t, c);
+      return;
+    }
+  }
+  METRIC_ADD(history_replayed, ch->hist_len);
+}
+
+/*
+ * runs the timer of c that just fired. receiving a frame only stamps
+ * last_rx, the idle timer notices the activity when it fires and re-arms
+ * itself from there, so the hot path never touches the wheel
+ */
+void conn_timeout(struct conn_table *t, struct conn *c) {
+  uint64_t now = t->wheel.now_tick;
+  if (c->closing) return;
+  switch (c->timer_kind) {
+    case TIMER_IDLE:
+      if (c->last_rx + t->idle_ticks > now) {
+        timer_arm(&t->wheel, &c->timer, c->last_rx + t->idle_ticks);
+        return;
+      }
+      if (conn_enqueue(t, c, t->ping) == -1) {
+        conn_close(t, c);
+        return;
+      }
+      METRIC_ADD(pings_sent, 1);
+      c->ping_tick = now;
+      c->timer_kind = TIMER_PONG;
+      timer_arm(&t->wheel, &c->timer, now + ms_to_ticks(PONG_TIMEOUT_MS));
+      return;
+    case TIMER_PONG:
+      if (c->last_rx >= c->ping_tick) {
+        c->timer_kind = TIMER_IDLE;
+        timer_arm(&t->wheel, &c->timer, c->last_rx + t->idle_ticks);
+        return;
+      }
+      METRIC_ADD(idle_timeouts, 1);
+      conn_close(t, c);
+      return;
+    case TIMER_LINGER:
+      conn_close(t, c);
+      return;
+  }
+}
+
+/*
+ * records how long one pass of the event loop spent doing work
+ */
+void metrics_loop(uint64_t ns) {
+  METRIC_ADD(loop_iterations, 1);
+  METRIC_ADD(loop_ns_sum, ns);
+  METRIC_MAX(loop_ns_max, ns);
+  int b = 0;
+  while (b < LOOP_BUCKETS - 1 && ns > loop_bucket_ns[b]) ++b;
+  METRIC_ADD(loop_ns_le[b], 1);
+}
+
+/*
+ * renders a snapshot of the counters, in the prometheus text format or as
+ * a json object
+ * return the number of bytes written to out
+ */
+size_t metrics_format(char *out, size_t cap, int json) {
+  const struct {
+    const char *name;
+    _Atomic uint64_t *v;
+  } m[] = {
+      {"connections", &metrics.connections},
+      {"accepts", &metrics.accepts},
+      {"admission_rejects", &metrics.admission_rejects},
+      {"open_failures", &metrics.open_failures},
+      {"shm_accepts", &metrics.shm_accepts},
+      {"disconnects", &metrics.disconnects},
+      {"bytes_in", &metrics.bytes_in},
+      {"bytes_out", &metrics.bytes_out},
+      {"msgs_in", &metrics.msgs_in},
+      {"msgs_fanned_out", &metrics.msgs_fanned_out},
+      {"send_errors", &metrics.send_errors},
+      {"recv_errors", &metrics.recv_errors},
+      {"protocol_errors", &metrics.protocol_errors},
+      {"slow_consumer_drops", &metrics.slow_consumer_drops},
+      {"queued_bytes", &metrics.queued_bytes},
+      {"queued_bytes_max", &metrics.queued_bytes_max},
+      {"channels", &metrics.channels},
+      {"pings_sent", &metrics.pings_sent},
+      {"idle_timeouts", &metrics.idle_timeouts},
+      {"history_replayed", &metrics.history_replayed},
+      {"msglog_appended", &msglog.appended},
+      {"msglog_dropped", &msglog.dropped},
+      {"msglog_synced", &msglog.synced},
+      {"msglog_syncs", &msglog.syncs},
+      {"msglog_replayed", &msglog.replayed},
+      {"loop_iterations", &metrics.loop_iterations},
+      {"loop_ns_sum", &metrics.loop_ns_sum},
+      {"loop_ns_max", &metrics.loop_ns_max},
+  };
+  size_t n = 0;
+  int nm = sizeof(m) / sizeof(m[0]);
+  uint64_t cumulative = 0;
+  if (json) n += snprintf(out + n, cap - n, "{");
+  for (int i = 0; i < nm && n < cap; ++i) {
+    uint64_t v = atomic_load_explicit(m[i].v, memory_order_relaxed);
+    n += snprintf(out + n, cap - n,
+                  json ? "\"%s\":%llu," : "pollserver_%s %llu\n", m[i].name,
+                  (unsigned long long)v);
+  }
+  if (json && n < cap) n += snprintf(out + n, cap - n, "\"loop_ns_le\":{");
+  for (int b = 0; b < LOOP_BUCKETS && n < cap; ++b) {
+    cumulative += METRIC_GET(loop_ns_le[b]);
+    char le[24] = "+Inf";
+    if (b < LOOP_BUCKETS - 1) {
+      snprintf(le, sizeof(le), "%llu", (unsigned long long)loop_bucket_ns[b]);
+    }
+    n += snprintf(out + n, cap - n,
+                  json ? "%s\"%s\":%llu"
+                       : "%spollserver_loop_ns_bucket{le=\"%s\"} %llu\n",
+                  json && b > 0 ? "," : "", le,
+                  (unsigned long long)cumulative);
+  }
+  if (json && n < cap) n += snprintf(out + n, cap - n, "}}\n");
+  return n < cap ? n : cap;
+}
+
+/*
+ * answers a metrics request once its line is complete, "json" selects json
+ * and anything else the text format. the connection closes after the reply
+ */
+void handle_metrics(struct conn_table *t, struct conn *c) {
+  if (c->linger) return;  // already answered
+  struct frame_reader *r = &c->reader;
+  ssize_t nbytes = frame_reader_fill(r, c->fd);
+  if (nbytes == -1) {
+    if (errno != EAGAIN && errno != EINTR) conn_close(t, c);
+    return;
+  }
+  size_t avail = r->tail - r->head;
+  if (nbytes > 0 && memchr(r->buf + r->head, '\n', avail) == NULL) {
+    if (avail > 64) conn_close(t, c);  // not a metrics client
+    return;
+  }
+  int json = avail >= 4 && memcmp(r->buf + r->head, "json", 4) == 0;
+  char out[2048];
+  size_t len = metrics_format(out, sizeof(out), json);
+  struct msgbuf *mb = msgbuf_new(len);
+  if (mb == NULL) {
+    conn_close(t, c);
+    return;
+  }
+  memcpy(mb->data, out, len);
+  if (conn_enqueue(t, c, mb) == -1) conn_close(t, c);
+  msgbuf_put(mb);
+  conn_linger(t, c);
+}
+
+/*
+ * fetches a unix stream socket listening on path
+ * return -1 on error
+ */
+int get_unix_listener(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, BACKLOG) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/*
+ * prints the events recorded since the last call, run once the loop has
+ * nothing left to do before it blocks in poll
+ */
+void log_flush() {
+  if (log_ring.len == 0 && log_ring.dropped == 0) return;
+  char ip[INET6_ADDRSTRLEN];
+  for (; log_ring.len > 0; --log_ring.len) {
+    struct log_entry *e = &log_ring.entries[log_ring.head];
+    log_ring.head = (log_ring.head + 1) % LOG_RING;
+    if (e->family == AF_UNSPEC ||
+        inet_ntop(e->family, e->addr, ip, sizeof(ip)) == NULL) {
+      strcpy(ip, "?");
+    }
+    switch (e->kind) {
+      case LOG_CONNECT:
+        printf("pollserver got a connection from %s on socket %d\n", ip,
+               e->fd);
+        break;
+      case LOG_HANGUP:
+        printf("pollserver: socket %d hung up\n", e->fd);
+        break;
+      case LOG_REJECT:
+        printf("pollserver: refused a connection from %s\n", ip);
+        break;
+      case LOG_SHM_CONNECT:
+        printf("pollserver got a shared memory connection on %d\n", e->fd);
+        break;
+      case LOG_OPEN_FAILED:
+        printf("pollserver: no room for a connection from %s\n", ip);
+        break;
+      case LOG_SLOW_CONSUMER:
+        printf("pollserver: socket %d fell behind\n", e->fd);
+        break;
+      case LOG_RECV_FAILED:
+        printf("pollserver: recv on socket %d: %s\n", e->fd,
+               strerror(e->err));
+        break;
+      case LOG_BAD_FRAME:
+        printf("pollserver: bad frame on socket %d\n", e->fd);
+        break;
+      case LOG_JOIN_FAILED:
+        printf("pollserver: socket %d failed to join\n", e->fd);
+        break;
+    }
+  }
+  if (log_ring.dropped > 0) {
+    printf("pollserver: %llu log events dropped\n",
+           (unsigned long long)log_ring.dropped);
+    log_ring.dropped = 0;
+  }
+  fflush(stdout);
+}
+
+/*
+ * charges one connection to the bucket of the source address
+ * return 1 if the connection may proceed, 0 if the address is over its rate
+ */
+int admit(struct admission *a, const struct sockaddr_storage *ss,
+          uint64_t now) {
+  uint8_t addr[16] = {0};
+  if (a->rate == 0) return 1;
+  if (ss->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *)ss;
+    addr[10] = addr[11] = 0xff;
+    memcpy(addr + 12, &sin->sin_addr, 4);
+  } else if (ss->ss_family == AF_INET6) {
+    memcpy(addr, &((const struct sockaddr_in6 *)ss)->sin6_addr, 16);
+  } else {
+    return 1;
+  }
+  // local benchmarks and health checks all share one address
+  static const uint8_t loopback6[16] = {[15] = 1};
+  if ((addr[10] == 0xff && addr[12] == 127 && !memcmp(addr, loopback6, 10)) ||
+      !memcmp(addr, loopback6, 16)) {
+    return 1;
+  }
+
+  uint64_t hash = channel_hash((const char *)addr, sizeof(addr));
+  struct admit_bucket *b = NULL, *stalest = NULL;
+  for (int i = 0; i < ADMIT_PROBE; ++i) {
+    struct admit_bucket *s = &a->slots[(hash + i) & (ADMIT_SLOTS - 1)];
+    if (s->last_ns != 0 && memcmp(s->addr, addr, sizeof(addr)) == 0) {
+      b = s;
+      break;
+    }
+    if (stalest == NULL || s->last_ns < stalest->last_ns) stalest = s;
+  }
+  if (b == NULL) {
+    b = stalest;
+    memcpy(b->addr, addr, sizeof(addr));
+    b->last_ns = now;
+    b->tokens = a->burst * 1000;
+  }
+  uint64_t refill = (now - b->last_ns) * a->rate / 1000000;  // millitokens
+  b->tokens += refill;
+  if (b->tokens > a->burst * 1000) b->tokens = a->burst * 1000;
+  if (refill > 0) b->last_ns = now;
+  if (b->tokens < 1000) return 0;
+  b->tokens -= 1000;
+  return 1;
+}
+
+/*
+ * reads whatever arrived on a chat connection and acts on every complete
+ * frame in it
+ */
+void handle_client(struct conn_table *conns, struct channel_table *chans,
+                   struct conn *c) {
+  int sender_fd = c->fd;
+  ssize_t nbytes;
+  if (c->shm.pair != NULL) {
+    // the wakeup may as well mean the client made room in our ring
+    if (c->wq_len > 0) conn_mark_dirty(conns, c);
+    nbytes = shm_link_fill(&c->shm, &c->reader);
+  } else {
+    nbytes = frame_reader_fill(&c->reader, sender_fd);
+  }
+  if (nbytes <= 0) {
+    if (nbytes == -1 && (errno == EAGAIN || errno == EINTR)) return;
+    if (nbytes == 0) {  // connection closed by a client
+      log_event(LOG_HANGUP, sender_fd, NULL);
+    } else {
+      METRIC_ADD(recv_errors, 1);
+      log_event(LOG_RECV_FAILED, sender_fd, NULL);
+    }
+    conn_close(conns, c);
+    return;
+  }
+  c->stats.bytes_in += nbytes;
+  c->last_rx = conns->wheel.now_tick;
+  METRIC_ADD(bytes_in, nbytes);
+  struct frame f;
+  int rv = 0;
+  // stops early once c is closed, by a refused join or a full write queue
+  while (!c->closing && (rv = frame_reader_next(&c->reader, &f)) == 1) {
+    c->stats.msgs_in++;
+    METRIC_ADD(msgs_in, 1);
+    if (f.type == FRAME_MSG) {
+      channel_publish(conns, chans, c, &f);
+    } else if (f.type == FRAME_JOIN) {
+      struct channel *ch = channel_get(chans, f.data, f.len, 1);
+      int joined = ch ? channel_join(ch, c) : -1;
+      if (joined == -1) {
+        // a name that is too long or one channel too many. a client that
+        // gets this wrong would only keep asking
+        METRIC_ADD(protocol_errors, 1);
+        log_event(LOG_JOIN_FAILED, sender_fd, NULL);
+        conn_close(conns, c);
+      } else if (joined == 1) {
+        channel_replay(conns, ch, c);
+      }
+    } else if (f.type == FRAME_LEAVE) {
+      struct channel *ch = channel_get(chans, f.data, f.len, 0);
+      int k = ch ? channel_find(c, ch) : -1;
+      if (k != -1) channel_leave(chans, c, k);
+    }
+    // FRAME_PONG needs no handling, any frame counts as a sign of life
+  }
+  if (rv == -1) {
+    METRIC_ADD(protocol_errors, 1);
+    log_event(LOG_BAD_FRAME, sender_fd, NULL);
+    conn_close(conns, c);
+  }
+}
+
+/*
+ * puts a message read back from the log into the history of its channel,
+ * so joiners after a restart see what was said before it
+ */
+void msglog_to_history(void *arg, const char *data, size_t len) {
+  struct channel_table *chans = arg;
+  uint64_t payload_len;
+  int n = varint_decode((const uint8_t *)data, len, &payload_len);
+  if (n <= 0 || (size_t)n + 1 + payload_len != len ||
+      data[n] != FRAME_MSG) {
+    return;
+  }
+  struct frame f = {FRAME_MSG, (uint32_t)payload_len, (char *)data + n + 1};
+  const char *name, *text;
+  size_t name_len, text_len;
+  if (frame_msg_split(&f, &name, &name_len, &text, &text_len) == -1) return;
+  struct channel *ch = channel_get(chans, name, name_len, 1);
+  struct msgbuf *mb = ch ? msgbuf_new(len) : NULL;
+  if (mb == NULL) return;
+  memcpy(mb->data, data, len);
+  channel_remember(chans, ch, mb);
+  msgbuf_put(mb);
+}
+
+/*
+ * drains the accept queue of listener, up to ACCEPT_BATCH connections so a
+ * storm cannot starve the connections already being served
+ */
+void accept_clients(struct conn_table *t, struct channel *lobby,
+                    int listener) {
+  uint64_t now = now_ns();
+  for (int n = 0; n < ACCEPT_BATCH; ++n) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    int fd = accept4(listener, (struct sockaddr *)&addr, &addrlen,
+                     SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+      return;
+    }
+    if (!admit(&admission, &addr, now)) {
+      METRIC_ADD(admission_rejects, 1);
+      log_event(LOG_REJECT, fd, (struct sockaddr *)&addr);
+      close(fd);
+      continue;
+    }
+    struct conn *c = conn_open(t, fd, CONN_CLIENT);
+    if (c == NULL) {
+      METRIC_ADD(open_failures, 1);
+      log_event(LOG_OPEN_FAILED, fd, (struct sockaddr *)&addr);
+      close(fd);
+      continue;
+    }
+    METRIC_ADD(accepts, 1);
+    METRIC_ADD(connections, 1);
+    if (channel_join(lobby, c) == -1) {
+      conn_close(t, c);
+      continue;
+    }
+    channel_replay(t, lobby, c);
+    log_event(LOG_CONNECT, fd, (struct sockaddr *)&addr);
+  }
+}
+
+/*
+ * hands a ring pair to every client waiting on the shared memory listener.
+ * the unix socket is only used for the handshake, the connection lives on
+ * as the server eventfd of the pair
+ */
+void accept_shm_clients(struct conn_table *t, struct channel *lobby,
+                        int listener) {
+  for (int n = 0; n < ACCEPT_BATCH; ++n) {
+    int sock = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+      return;
+    }
+    struct shm_link link;
+    int fds[3];
+    if (shm_pair_create(&link, fds) == -1) {
+      perror("shm_pair_create");
+      close(sock);
+      continue;
+    }
+    int sent = shm_send_fds(sock, fds);
+    close(fds[0]);
+    close(sock);
+    struct conn *c = NULL;
+    if (sent == -1 || (c = conn_open(t, link.wait_fd, CONN_CLIENT)) == NULL) {
+      METRIC_ADD(open_failures, 1);
+      log_event(LOG_OPEN_FAILED, link.wait_fd, NULL);
+      shm_link_close(&link);
+      continue;
+    }
+    c->shm = link;
+    METRIC_ADD(accepts, 1);
+    METRIC_ADD(shm_accepts, 1);
+    METRIC_ADD(connections, 1);
+    if (channel_join(lobby, c) == -1) {
+      conn_close(t, c);
+      continue;
+    }
+    channel_replay(t, lobby, c);
+    log_event(LOG_SHM_CONNECT, c->fd, NULL);
+  }
+}
+
+int main(int argc, char *argv[]) {
   int listener;
+  int metrics_listener = -1;
+  const char *metrics_path = METRICS_PATH;
+  int shm_listener = -1;
+  const char *shm_path = SHM_PATH;
   int new_fd;
-  struct sockaddr_storage remoteaddr;
-  socklen_t addrlen;
+  int backlog = BACKLOG;
+  struct conn_table conns;
+  struct channel_table chans;
+  struct channel *lobby;
 
-  char buf[255];
-  char remoteIp[INET6_ADDRSTRLEN];
-  int fd_count = 0;
-  int fd_size = 5;
-  struct pollfd *pfds = malloc(sizeof(*pfds) * fd_size);
+  int opt;
+  int idle_seconds = IDLE_SECONDS;
+  int history_len = HISTORY_LEN;
+  const char *log_dir = NULL;
+  uint64_t log_window_ms = MSGLOG_WINDOW_MS;
+  while ((opt = getopt(argc, argv, "m:u:i:H:b:a:A:L:D:")) != -1) {
+    switch (opt) {
+      case 'u':  // an empty path disables the shared memory transport
+        shm_path = optarg;
+        break;
+      case 'm':  // an empty path disables the metrics socket
+        metrics_path = optarg;
+        break;
+      case 'i':  // 0 disables heartbeats and idle timeouts
+        idle_seconds = atoi(optarg);
+        break;
+      case 'H':  // 0 disables history
+        history_len = atoi(optarg);
+        if (history_len < 0 || history_len > HISTORY_LEN) {
+          fprintf(stderr, "history length must be 0 to %d\n", HISTORY_LEN);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'b':
+        backlog = atoi(optarg);
+        break;
+      case 'a':  // connections per second per address, 0 disables
+        admission.rate = strtoull(optarg, NULL, 10);
+        break;
+      case 'A':
+        admission.burst = strtoull(optarg, NULL, 10);
+        break;
+      case 'L':  // directory of the message log, off unless given
+        log_dir = optarg;
+        break;
+      case 'D':  // ms a logged message may wait for its flush, 0 syncs asap
+        log_window_ms = strtoull(optarg, NULL, 10);
+        break;
+      default:
+        fprintf(stderr,
+                "Usage: %s [-m metrics_socket] [-u shm_socket] "
+                "[-i idle_seconds] "
+                "[-H history_len] [-b backlog] [-a admit_rate] "
+                "[-A admit_burst] [-L log_dir] [-D durability_ms]\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
 
-  listener = get_listener();
+  if (conn_table_init(&conns) == -1 || channel_table_init(&chans, 64) == -1 ||
+      (lobby = channel_get(&chans, "", 0, 1)) == NULL) {
+    perror("init");
+    exit(EXIT_FAILURE);
+  }
+  conns.idle_ticks = ms_to_ticks((uint64_t)idle_seconds * 1000);
+  chans.history_len = history_len;
+  if (log_dir != NULL) {
+    if (msglog_open(&msglog, log_dir, log_window_ms,
+                    history_len > 0 ? msglog_to_history : NULL,
+                    &chans) == -1) {
+      perror("message log");
+      exit(EXIT_FAILURE);
+    }
+    printf("pollserver: replayed %llu logged messages\n",
+           (unsigned long long)atomic_load(&msglog.replayed));
+    fflush(stdout);
+  }
+  listener = get_listener(backlog);
   if (listener == -1) {
     fprintf(stderr, "error getting listening socket\n");
     exit(1);
   }
-  pfds[0].fd = listener;
-  pfds[0].events = POLLIN;
-  fd_count = 1;
+  conns.pfds[0].fd = listener;
+  conns.pfds[0].events = POLLIN;
+  conns.fd_count = 1;
+  if (metrics_path[0] != '\0') {
+    metrics_listener = get_unix_listener(metrics_path);
+    if (metrics_listener == -1) {
+      perror("metrics socket");
+      exit(EXIT_FAILURE);
+    }
+    conns.pfds[conns.fd_count].fd = metrics_listener;
+    conns.pfds[conns.fd_count++].events = POLLIN;
+  }
+  if (shm_path[0] != '\0') {
+    shm_listener = get_unix_listener(shm_path);
+    if (shm_listener == -1) {
+      perror("shared memory socket");
+      exit(EXIT_FAILURE);
+    }
+    conns.pfds[conns.fd_count].fd = shm_listener;
+    conns.pfds[conns.fd_count++].events = POLLIN;
+  }
   for (;;) {
-    int poll_count = poll(pfds, fd_count, -1);
+    struct pollfd *pfds = conns.pfds;
+    log_flush();
+    int timeout = timer_wheel_timeout(&conns.wheel, now_ns());
+    int poll_count = poll(pfds, conns.fd_count, timeout);
     if (poll_count == -1) {
       perror("poll");
       exit(EXIT_FAILURE);
     }
-    for (int i = 0; i < fd_count; ++i) {
-      if (pfds[i].revents & POLLIN) {
-        if (pfds[i].fd == listener) {  // we got a new connection
-          addrlen = sizeof(remoteaddr);
-          new_fd = accept(listener, (struct sockaddr *)&remoteaddr, &addrlen);
-          if (new_fd == -1) {
-            perror("accept");
-          } else {
-            add_to_pfds(&pfds, new_fd, &fd_count, &fd_size);
-            printf("pollserver got a connection from %s on socket %d\n",
-                   inet_ntop(remoteaddr.ss_family,
-                             get_in_addr((struct sockaddr *)&remoteaddr),
-                             remoteIp, sizeof(remoteIp)),
-                   new_fd);
-          }
+    uint64_t tick_start = now_ns();
+    // bring the wheel up to date before anything stamps last_rx or arms a
+    // timer, after a poll with no timer armed now_tick can be long stale
+    struct timer fired;
+    timer_wheel_advance(&conns.wheel, tick_start, &fired);
+    while (fired.next != &fired) {
+      struct timer *tm = fired.next;
+      timer_list_unlink(tm);
+      conn_timeout(&conns, (struct conn *)((char *)tm -
+                                           offsetof(struct conn, timer)));
+    }
+    // connections accepted during the scan are appended past scan_count
+    int scan_count = conns.fd_count;
+    for (int i = 0; i < scan_count; ++i) {
+      if (pfds[i].fd == listener) {
+        if (pfds[i].revents & POLLIN) accept_clients(&conns, lobby, listener);
+      } else if (pfds[i].fd == shm_listener) {
+        if (pfds[i].revents & POLLIN) {
+          accept_shm_clients(&conns, lobby, shm_listener);
+        }
+      } else if (pfds[i].fd == metrics_listener) {
+        if (!(pfds[i].revents & POLLIN)) continue;
+        new_fd = accept4(metrics_listener, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (new_fd != -1 && conn_open(&conns, new_fd, CONN_METRICS) == NULL) {
+          close(new_fd);
+        }
+      } else if (pfds[i].revents) {
+        struct conn *c = conns.by_fd[pfds[i].fd];
+        if (c->closing) continue;
+        if (pfds[i].revents & POLLOUT) {  // socket drained, resume writing
+          conn_mark_dirty(&conns, c);
+        }
+        if (!(pfds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        if (c->kind == CONN_METRICS) {
+          handle_metrics(&conns, c);
         } else {
-          int nbytes = recv(pfds[i].fd, buf, sizeof(buf), 0);
-          int sender_fd = pfds[i].fd;
-          if (nbytes <= 0) {
-            if (nbytes == 0) {  // connection closed by a client
-              printf("pollserver: socket %d hung up\n", sender_fd);
-            } else {
-              perror("recv");
-            }
-            close(pfds[i].fd);
-            del_from_pfds(pfds, i, &fd_count);
-          } else {
-            for (int j = 0; j < fd_count; ++j) {
-              int dest_fd = pfds[j].fd;
-              if (dest_fd != listener && dest_fd != sender_fd) {
-                if (send(dest_fd, buf, nbytes, 0) == -1) {
-                  perror("send");
-                }
-              }
-            }
-          }
+          handle_client(&conns, &chans, c);
         }
       }
     }
+    conn_flush_all(&conns);
+    conn_reap(&conns, &chans);
+    metrics_loop(now_ns() - tick_start);
   }
   return 0;
 }
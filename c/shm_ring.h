@@ -0,0 +1,397 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+/*
+ * shared memory transport between pollserver and clients on the same host.
+ *
+ * a client connects to the unix socket of the server and is handed three
+ * descriptors with SCM_RIGHTS: a memfd holding a struct shm_pair, the
+ * eventfd the server polls and the eventfd the client polls. each
+ * direction is a single producer, single consumer byte ring carrying the
+ * same frames as the TCP stream, so both ends parse it with frame_reader.
+ *
+ * an eventfd is only written after the other side announced it is about
+ * to sleep, so a busy pair exchanges messages without system calls.
+ *
+ * closing sets pair->closed and wakes the peer. an end that dies without
+ * closing leaves no trace an eventfd could report, the server only reaps it
+ * through the idle heartbeat and never does when heartbeats are off (-i 0).
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "frame.h"
+
+#define SHM_RING_SIZE (1u << 20)  // bytes per direction, a power of two
+#define SHM_MAGIC 0x70736d31      // "psm1"
+
+/*
+ * head and tail count every byte ever written and read, the producer only
+ * stores head and the consumer only stores tail. each lives on its own
+ * cache line together with the sleeping flag the other side sets
+ */
+struct shm_ring {
+  _Alignas(64) _Atomic uint64_t head;
+  _Atomic uint32_t reader_sleeping;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Atomic uint32_t writer_sleeping;
+  _Alignas(64) char data[SHM_RING_SIZE];
+};
+
+struct shm_pair {
+  uint32_t magic;
+  _Atomic uint32_t closed;  // set by whichever side leaves first
+  struct shm_ring up;       // client to server
+  struct shm_ring down;     // server to client
+};
+
+/*
+ * one end of a ring pair, wait_fd becomes readable when the peer wants
+ * attention and wake_fd is written to get the attention of the peer.
+ * the counters this end owns are kept here as well, the copies in the
+ * pair are only published for the peer and never read back
+ */
+struct shm_link {
+  struct shm_pair *pair;
+  struct shm_ring *tx;
+  struct shm_ring *rx;
+  int wait_fd;
+  int wake_fd;
+  uint64_t tx_head;
+  uint64_t tx_tail;  // last tail of tx the peer published
+  uint64_t rx_tail;
+};
+
+static inline void shm_wake(int fd) {
+  uint64_t one = 1;
+  ssize_t rv = write(fd, &one, sizeof(one));
+  (void)rv;  // a full counter already means a pending wakeup
+}
+
+static inline size_t shm_ring_used(struct shm_ring *r) {
+  return atomic_load_explicit(&r->head, memory_order_acquire) -
+         atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+/*
+ * free space in the tx ring for a writer at head. tail comes from memory
+ * the peer can scribble, one that moved backwards or past head is refused
+ * rather than trusted to size a memcpy
+ * return the free bytes, -1 with errno EPROTO on a corrupt tail
+ */
+static inline ssize_t shm_link_room(struct shm_link *l, uint64_t head) {
+  uint64_t tail = atomic_load(&l->tx->tail);
+  if (tail - l->tx_tail > head - l->tx_tail) {
+    errno = EPROTO;
+    return -1;
+  }
+  l->tx_tail = tail;
+  return SHM_RING_SIZE - (head - tail);
+}
+
+/*
+ * copies as much of iov into the tx ring as fits. if not everything fit,
+ * the reader is asked to wake us once it made room
+ * return the number of bytes written, -1 with errno EPROTO if the peer
+ * corrupted the ring
+ */
+static inline ssize_t shm_link_writev(struct shm_link *l,
+                                      const struct iovec *iov, int cnt) {
+  struct shm_ring *r = l->tx;
+  uint64_t head = l->tx_head;
+  size_t written = 0;
+  for (int i = 0; i < cnt; ++i) {
+    const char *src = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+    for (;;) {
+      ssize_t room = shm_link_room(l, head);
+      if (room == -1) return -1;
+      size_t n = len < (size_t)room ? len : (size_t)room;
+      size_t off = head & (SHM_RING_SIZE - 1);
+      size_t first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+      memcpy(r->data + off, src, first);
+      memcpy(r->data, src + first, n - first);
+      head += n;
+      written += n;
+      src += n;
+      len -= n;
+      if (len == 0) break;
+      // full. publish what we have, then look once more after asking for
+      // a wakeup so space freed in between is not missed
+      atomic_store(&r->head, head);
+      l->tx_head = head;
+      atomic_store(&r->writer_sleeping, 1);
+      if ((room = shm_link_room(l, head)) <= 0) {
+        if (room == -1) return -1;
+        goto done;
+      }
+      atomic_store(&r->writer_sleeping, 0);
+    }
+  }
+done:
+  atomic_store(&r->head, head);
+  l->tx_head = head;
+  if (written > 0 && atomic_exchange(&r->reader_sleeping, 0)) {
+    shm_wake(l->wake_fd);
+  }
+  return (ssize_t)written;
+}
+
+/*
+ * receives whatever the peer wrote into the reader, mirroring
+ * frame_reader_fill
+ * return the number of bytes read, 0 once the peer closed the pair and -1
+ * with errno EAGAIN if there is nothing to read
+ */
+static inline ssize_t shm_link_fill(struct shm_link *l,
+                                    struct frame_reader *fr) {
+  struct shm_ring *r = l->rx;
+  uint64_t pending;
+  ssize_t rv = read(l->wait_fd, &pending, sizeof(pending));
+  (void)rv;  // drain the wakeup counter, the ring is the source of truth
+
+  if (fr->head == fr->tail) {
+    fr->head = fr->tail = 0;
+  } else if (fr->tail == fr->cap) {
+    if (frame_reader_reserve(fr, fr->tail - fr->head + 1) == -1) {
+      errno = ENOMEM;
+      return -1;
+    }
+  }
+  uint64_t tail = l->rx_tail;
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) {
+    if (atomic_load(&l->pair->closed)) return 0;
+    atomic_store(&r->reader_sleeping, 1);
+    if (atomic_load(&r->head) == tail) {
+      if (atomic_load(&l->pair->closed)) return 0;
+      errno = EAGAIN;
+      return -1;
+    }
+    atomic_store(&r->reader_sleeping, 0);
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+  }
+  size_t avail = head - tail;
+  if (avail > SHM_RING_SIZE) {  // head lives in memory the peer can scribble
+    errno = EPROTO;
+    return -1;
+  }
+  size_t n = avail < fr->cap - fr->tail ? avail : fr->cap - fr->tail;
+  size_t off = tail & (SHM_RING_SIZE - 1);
+  size_t first = n < SHM_RING_SIZE - off ? n : SHM_RING_SIZE - off;
+  memcpy(fr->buf + fr->tail, r->data + off, first);
+  memcpy(fr->buf + fr->tail + first, r->data, n - first);
+  fr->tail += n;
+  l->rx_tail = tail + n;
+  atomic_store(&r->tail, tail + n);
+  if (atomic_exchange(&r->writer_sleeping, 0)) shm_wake(l->wake_fd);
+  if (n == avail) {
+    // drained, ask for a wakeup and look again for bytes written meanwhile.
+    // a peer that closed right after its last write already spent its
+    // wakeup on this call, so wake ourselves to report the close next time
+    atomic_store(&r->reader_sleeping, 1);
+    if (atomic_load(&r->head) == tail + n && !atomic_load(&l->pair->closed)) {
+      return (ssize_t)n;
+    }
+  }
+  // whatever is left is picked up on the next poll
+  shm_wake(l->wait_fd);
+  return (ssize_t)n;
+}
+
+/*
+ * writes all of iov, sleeping on wait_fd while the ring is full. for
+ * blocking callers such as the interactive client
+ * return 0 on success, -1 if the peer went away or broke the ring
+ */
+static inline int shm_link_sendv(struct shm_link *l, const struct iovec *iov,
+                                 int cnt) {
+  struct iovec v[8];
+  if (cnt > 8) return -1;
+  memcpy(v, iov, sizeof(*iov) * cnt);
+  struct iovec *p = v;
+  for (;;) {
+    ssize_t n = shm_link_writev(l, p, cnt);
+    if (n == -1) return -1;
+    while (cnt > 0 && (size_t)n >= p->iov_len) {
+      n -= p->iov_len;
+      ++p;
+      --cnt;
+    }
+    if (cnt == 0) break;
+    p->iov_base = (char *)p->iov_base + n;
+    p->iov_len -= n;
+    if (atomic_load(&l->pair->closed)) return -1;
+    struct pollfd pfd = {.fd = l->wait_fd, .events = POLLIN};
+    poll(&pfd, 1, 100);
+    uint64_t pending;
+    ssize_t rv = read(l->wait_fd, &pending, sizeof(pending));
+    (void)rv;
+  }
+  // the wakeups drained above may have been for incoming data
+  if (shm_ring_used(l->rx) > 0) shm_wake(l->wait_fd);
+  return 0;
+}
+
+/*
+ * frame_sendv over a ring pair
+ */
+static inline int shm_frame_sendv(struct shm_link *l, uint8_t type,
+                                  const struct iovec *parts, int nparts) {
+  uint8_t hdr[FRAME_MAX_HEADER];
+  struct iovec iov[8];
+  size_t len = 0;
+  if (nparts > 7) return -1;
+  for (int i = 0; i < nparts; ++i) {
+    iov[i + 1] = parts[i];
+    len += parts[i].iov_len;
+  }
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = frame_header_encode(type, len, hdr);
+  return shm_link_sendv(l, iov, nparts + 1);
+}
+
+/*
+ * marks the pair closed, wakes the peer so it notices and releases this end
+ */
+static inline void shm_link_close(struct shm_link *l) {
+  if (l->pair == NULL) return;
+  atomic_store(&l->pair->closed, 1);
+  shm_wake(l->wake_fd);
+  munmap(l->pair, sizeof(*l->pair));
+  close(l->wait_fd);
+  close(l->wake_fd);
+  l->pair = NULL;
+}
+
+/*
+ * creates a ring pair, fills in the server end and the descriptors to hand
+ * to the client: the memfd, the server eventfd and the client eventfd. the
+ * caller closes fds[0] once it was sent
+ * return 0 on success, -1 on error
+ */
+static inline int shm_pair_create(struct shm_link *server, int fds[3]) {
+  fds[0] = memfd_create("pollserver-ring", MFD_CLOEXEC);
+  fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct shm_pair *pair = MAP_FAILED;
+  if (fds[0] != -1 && fds[1] != -1 && fds[2] != -1 &&
+      ftruncate(fds[0], sizeof(*pair)) == 0) {
+    pair = mmap(NULL, sizeof(*pair), PROT_READ | PROT_WRITE, MAP_SHARED,
+                fds[0], 0);
+  }
+  if (pair == MAP_FAILED) {
+    for (int i = 0; i < 3; ++i) {
+      if (fds[i] != -1) close(fds[i]);
+    }
+    return -1;
+  }
+  // the rest of a fresh memfd reads as zeros. both readers start out
+  // asleep, so the first bytes written in either direction wake them
+  pair->magic = SHM_MAGIC;
+  pair->up.reader_sleeping = 1;
+  pair->down.reader_sleeping = 1;
+  *server = (struct shm_link){
+      .pair = pair,
+      .tx = &pair->down,
+      .rx = &pair->up,
+      .wait_fd = fds[1],
+      .wake_fd = fds[2],
+  };
+  return 0;
+}
+
+/*
+ * connects to the server listening on path and maps the ring pair it hands
+ * out
+ * return 0 on success, -1 on error
+ */
+static inline int shm_connect(const char *path, struct shm_link *l) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock == -1) return -1;
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(sock);
+    return -1;
+  }
+
+  char byte;
+  int fds[3];
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(fds))];
+  } ctl;
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = ctl.buf,
+      .msg_controllen = sizeof(ctl.buf),
+  };
+  ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  close(sock);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != 1 || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+    errno = EPROTO;
+    return -1;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  struct shm_pair *pair = mmap(NULL, sizeof(*pair), PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fds[0], 0);
+  close(fds[0]);
+  if (pair == MAP_FAILED || pair->magic != SHM_MAGIC) {
+    if (pair != MAP_FAILED) munmap(pair, sizeof(*pair));
+    close(fds[1]);
+    close(fds[2]);
+    errno = EPROTO;
+    return -1;
+  }
+  *l = (struct shm_link){
+      .pair = pair,
+      .tx = &pair->up,
+      .rx = &pair->down,
+      .wait_fd = fds[2],
+      .wake_fd = fds[1],
+  };
+  return 0;
+}
+
+/*
+ * hands the client end of a pair to the peer of sock, see shm_pair_create
+ * return 0 on success, -1 on error
+ */
+static inline int shm_send_fds(int sock, const int fds[3]) {
+  char byte = 0;
+  union {
+    struct cmsghdr hdr;
+    char buf[CMSG_SPACE(sizeof(int) * 3)];
+  } ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  struct iovec iov = {&byte, 1};
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = ctl.buf,
+      .msg_controllen = sizeof(ctl.buf),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * 3);
+  return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+#endif  // SHM_RING_H
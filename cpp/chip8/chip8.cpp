@@ -0,0 +1,426 @@
+#include "chip8.hpp"
+
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+
+namespace {
+
+constexpr uint8_t fontset[FONTSET_SIZE] = {
+    0xF0, 0x90, 0x90, 0x90, 0xF0,  // 0
+    0x20, 0x60, 0x20, 0x20, 0x70,  // 1
+    0xF0, 0x10, 0xF0, 0x80, 0xF0,  // 2
+    0xF0, 0x10, 0xF0, 0x10, 0xF0,  // 3
+    0x90, 0x90, 0xF0, 0x10, 0x10,  // 4
+    0xF0, 0x80, 0xF0, 0x10, 0xF0,  // 5
+    0xF0, 0x80, 0xF0, 0x90, 0xF0,  // 6
+    0xF0, 0x10, 0x20, 0x40, 0x40,  // 7
+    0xF0, 0x90, 0xF0, 0x90, 0xF0,  // 8
+    0xF0, 0x90, 0xF0, 0x10, 0xF0,  // 9
+    0xF0, 0x90, 0xF0, 0x90, 0x90,  // A
+    0xE0, 0x90, 0xE0, 0x90, 0xE0,  // B
+    0xF0, 0x80, 0x80, 0x80, 0xF0,  // C
+    0xE0, 0x90, 0x90, 0x90, 0xE0,  // D
+    0xF0, 0x80, 0xF0, 0x80, 0xF0,  // E
+    0xF0, 0x80, 0xF0, 0x80, 0x80   // F
+};
+
+}  // namespace
+
+constexpr std::array<Chip8::Chip8Func, 0xF + 1> Chip8::table = {
+    &Chip8::Table0,  &Chip8::OP_1nnn, &Chip8::OP_2nnn, &Chip8::OP_3xkk,
+    &Chip8::OP_4xkk, &Chip8::OP_5xy0, &Chip8::OP_6xkk, &Chip8::OP_7xkk,
+    &Chip8::Table8,  &Chip8::OP_9xy0, &Chip8::OP_Annn, &Chip8::OP_Bnnn,
+    &Chip8::OP_Cxkk, &Chip8::OP_Dxyn, &Chip8::TableE,  &Chip8::TableF,
+};
+
+constexpr std::array<Chip8::Chip8Func, 0xE + 1> Chip8::table0 = [] {
+  std::array<Chip8Func, 0xE + 1> t{};
+  t.fill(&Chip8::OP_NULL);
+  t[0x0] = &Chip8::OP_00E0;
+  t[0xE] = &Chip8::OP_00EE;
+  return t;
+}();
+
+constexpr std::array<Chip8::Chip8Func, 0xE + 1> Chip8::table8 = [] {
+  std::array<Chip8Func, 0xE + 1> t{};
+  t.fill(&Chip8::OP_NULL);
+  t[0x0] = &Chip8::OP_8xy0;
+  t[0x1] = &Chip8::OP_8xy1;
+  t[0x2] = &Chip8::OP_8xy2;
+  t[0x3] = &Chip8::OP_8xy3;
+  t[0x4] = &Chip8::OP_8xy4;
+  t[0x5] = &Chip8::OP_8xy5;
+  t[0x6] = &Chip8::OP_8xy6;
+  t[0x7] = &Chip8::OP_8xy7;
+  t[0xE] = &Chip8::OP_8xyE;
+  return t;
+}();
+
+constexpr std::array<Chip8::Chip8Func, 0xE + 1> Chip8::tableE = [] {
+  std::array<Chip8Func, 0xE + 1> t{};
+  t.fill(&Chip8::OP_NULL);
+  t[0x1] = &Chip8::OP_ExA1;
+  t[0xE] = &Chip8::OP_Ex9E;
+  return t;
+}();
+
+constexpr std::array<Chip8::Chip8Func, 0x65 + 1> Chip8::tableF = [] {
+  std::array<Chip8Func, 0x65 + 1> t{};
+  t.fill(&Chip8::OP_NULL);
+  t[0x07] = &Chip8::OP_Fx07;
+  t[0x0A] = &Chip8::OP_Fx0A;
+  t[0x15] = &Chip8::OP_Fx15;
+  t[0x18] = &Chip8::OP_Fx18;
+  t[0x1E] = &Chip8::OP_Fx1E;
+  t[0x29] = &Chip8::OP_Fx29;
+  t[0x33] = &Chip8::OP_Fx33;
+  t[0x55] = &Chip8::OP_Fx55;
+  t[0x65] = &Chip8::OP_Fx65;
+  return t;
+}();
+
+Chip8::Chip8() {
+  pc = START_ADDRESS;
+  for (unsigned int i{0}; i < FONTSET_SIZE; ++i) {
+    memory[FONTSET_START_ADDRESS + i] = fontset[i];
+  }
+
+  // xorshift32 must never be seeded with zero
+  auto seed = std::chrono::system_clock::now().time_since_epoch().count();
+  rngState = static_cast<uint32_t>(seed ^ (seed >> 32)) | 1U;
+}
+
+uint8_t Chip8::RandomByte() {
+  rngState ^= rngState << 13U;
+  rngState ^= rngState >> 17U;
+  rngState ^= rngState << 5U;
+  return rngState >> 24U;
+}
+
+void Chip8::Render(uint32_t *pixels) const {
+  for (unsigned int row{0}; row < VIDEO_HEIGHT; ++row) {
+    uint64_t bits = video[row];
+    for (unsigned int col{0}; col < VIDEO_WIDTH; ++col) {
+      *pixels++ = (bits >> (63U - col)) & 1U ? 0xFFFFFFFF : 0;
+    }
+  }
+}
+
+void Chip8::LoadROM(std::string_view fileHandle) {
+  // open the rom and seek to end
+  std::ifstream file(fileHandle.data(), std::ios::binary | std::ios::ate);
+  if (file.is_open()) {
+    std::streampos size = file.tellg();
+    char *buffer = new char[size];  // temporary buffer to hold data
+    file.seekg(0, std::ios::beg);
+    file.read(buffer, size);
+    file.close();
+
+    for (int i{0}; i < size; ++i) {
+      memory[START_ADDRESS + i] = buffer[i];  // copy the rom to memory
+    }
+
+    delete[] buffer;
+  }
+}
+
+void Chip8::OP_NULL() {}
+
+void Chip8::OP_00E0() {
+  memset(video, 0, sizeof video);
+}
+
+void Chip8::OP_00EE() {
+  --sp;
+  pc = stack[sp];
+}
+
+void Chip8::OP_1nnn() {
+  uint16_t address = opcode & 0x0FFFU;
+  pc = address;
+}
+
+void Chip8::OP_2nnn() {
+  uint16_t address = opcode & 0x0FFFU;
+  stack[sp] = pc;
+  ++sp;
+  pc = address;
+}
+
+void Chip8::OP_3xkk() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t kk = opcode & 0x00FFU;
+  if (registers[Vx] == kk) {
+    pc += 2;
+  }
+}
+
+void Chip8::OP_4xkk() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t kk = opcode & 0x00FFU;
+  if (registers[Vx] != kk) {
+    pc += 2;
+  }
+}
+
+void Chip8::OP_5xy0() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+  if (registers[Vx] == registers[Vy]) {
+    pc += 2;
+  }
+}
+
+void Chip8::OP_6xkk() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t kk = opcode & 0x00FFU;
+
+  registers[Vx] = kk;
+}
+
+void Chip8::OP_7xkk() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t kk = opcode & 0x00FFU;
+
+  registers[Vx] = registers[Vx] + kk;
+}
+
+void Chip8::OP_8xy0() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+
+  registers[Vx] = registers[Vy];
+}
+
+void Chip8::OP_8xy1() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+
+  registers[Vx] = registers[Vx] or registers[Vy];
+}
+
+void Chip8::OP_8xy2() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+
+  registers[Vx] = registers[Vx] and registers[Vy];
+}
+
+void Chip8::OP_8xy3() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+
+  registers[Vx] = registers[Vx] xor registers[Vy];
+}
+
+void Chip8::OP_8xy4() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+  constexpr uint8_t Vf = 0xFU;
+
+  uint16_t sum = registers[Vx] + registers[Vy];
+
+  if (sum > 255U) {
+    registers[Vf] = 1U;
+  } else {
+    registers[Vf] = 0U;
+  }
+
+  registers[Vx] = sum & 0x00FFU;
+}
+
+void Chip8::OP_8xy5() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+  constexpr uint8_t Vf = 0xFU;
+
+  if (registers[Vx] > registers[Vy]) {
+    registers[Vf] = 1;
+  } else {
+    registers[Vf] = 0;
+  }
+
+  registers[Vx] = registers[Vx] - registers[Vy];
+}
+
+void Chip8::OP_8xy6() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  constexpr uint8_t Vf = 0xFU;
+
+  registers[Vf] = (registers[Vx] & 0x1u);
+  registers[Vx] >>= 1;
+}
+
+void Chip8::OP_8xy7() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+  constexpr uint8_t Vf = 0xFU;
+
+  registers[Vf] = (registers[Vy] > registers[Vx]) ? 1u : 0u;
+
+  registers[Vx] = registers[Vy] - registers[Vx];
+}
+
+void Chip8::OP_8xyE() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  constexpr uint8_t Vf = 0xFU;
+
+  registers[Vf] = (registers[Vx] & 0x80U) >> 7U;
+  registers[Vx] <<= 1;
+}
+
+void Chip8::OP_9xy0() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+
+  if (registers[Vx] != registers[Vy]) {
+    pc += 2;
+  }
+}
+
+void Chip8::OP_Annn() {
+  index = opcode & 0x0FFFU;
+}
+
+void Chip8::OP_Bnnn() {
+  uint16_t address = opcode & 0x0FFFU;
+  pc = registers[0] + address;
+}
+
+void Chip8::OP_Cxkk() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t kk = opcode & 0x00FFU;
+
+  registers[Vx] = RandomByte() & kk;
+}
+
+void Chip8::OP_Dxyn() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t Vy = (opcode & 0x00F0U) >> 4U;
+  uint8_t height = opcode & 0x000FU;
+  constexpr uint8_t Vf = 0xFU;
+
+  uint8_t xPos = registers[Vx] % VIDEO_WIDTH;
+  uint8_t yPos = registers[Vy] % VIDEO_HEIGHT;
+
+  // Sprites are clipped at the right and bottom edges of the screen
+  for (unsigned int row{0}; row < height && yPos + row < VIDEO_HEIGHT;
+       ++row) {
+    uint64_t spriteRow = uint64_t{memory[index + row]} << 56U >> xPos;
+
+    // Any sprite pixel landing on a lit screen pixel is a collision
+    if (video[yPos + row] & spriteRow) {
+      registers[Vf] = 1;
+    }
+
+    // Effectively XOR with the sprite pixels
+    video[yPos + row] ^= spriteRow;
+  }
+}
+
+void Chip8::OP_Ex9E() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t key = registers[Vx] & 0x0FU;
+  if (keys & (1U << key)) {
+    pc += 2;
+  }
+}
+
+void Chip8::OP_ExA1() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t key = registers[Vx] & 0x0FU;
+  if (!(keys & (1U << key))) {
+    pc += 2;
+  }
+}
+
+void Chip8::OP_Fx07() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  registers[Vx] = delayTimer;
+}
+
+void Chip8::OP_Fx0A() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  if (keys == 0) {
+    pc -= 2;  // wait by running this instruction again
+  } else {
+    registers[Vx] = std::countr_zero(keys);  // lowest held key wins
+  }
+}
+
+void Chip8::OP_Fx15() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  delayTimer = registers[Vx];
+}
+
+void Chip8::OP_Fx18() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  soundTimer = registers[Vx];
+}
+
+void Chip8::OP_Fx1E() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  index += registers[Vx];
+}
+
+void Chip8::OP_Fx29() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t digit = registers[Vx];
+  index = FONTSET_START_ADDRESS + (digit * 5);
+}
+
+void Chip8::OP_Fx33() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  uint8_t value = registers[Vx];
+  memory[index + 2] = value % 10;
+  value /= 10;
+  memory[index + 1] = value % 10;
+  value /= 10;
+  memory[index] = value % 10;
+}
+
+void Chip8::OP_Fx55() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  for (int i{0}; i <= Vx; ++i) {
+    memory[index + i] = registers[i];
+  }
+}
+
+void Chip8::OP_Fx65() {
+  uint8_t Vx = (opcode & 0x0F00U) >> 8U;
+  for (int i{0}; i <= Vx; ++i) {
+    registers[i] = memory[index + i];
+  }
+}
+
+void Chip8::Table0() {
+  ((*this).*(table0[opcode & 0x000Fu]))();
+}
+
+void Chip8::Table8() {
+  ((*this).*(table8[opcode & 0x000Fu]))();
+}
+
+void Chip8::TableE() {
+  ((*this).*(tableE[opcode & 0x000FU]))();
+}
+
+void Chip8::TableF() {
+  ((*this).*(tableF[opcode & 0x00FFU]))();
+}
+
+void Chip8::Cycle() {
+  opcode = ((memory[pc] << 8U) | memory[pc + 1]);
+  pc += 2;  // increment pc to next instruction
+  ((*this).*(table[(opcode & 0xF000U) >> 12U]))();
+
+  if (delayTimer > 0) {
+    --delayTimer;
+  }
+
+  if (soundTimer > 0) {
+    --soundTimer;
+  }
+}
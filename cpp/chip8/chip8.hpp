@@ -0,0 +1,99 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+constexpr unsigned int START_ADDRESS = 0x200;
+constexpr unsigned int FONTSET_START_ADDRESS = 0x50;
+constexpr unsigned int FONTSET_SIZE = 80;
+constexpr unsigned int VIDEO_WIDTH{64};
+constexpr unsigned int VIDEO_HEIGHT{32};
+
+// Everything a running machine mutates. It is trivially copyable and
+// ordered largest alignment first so it packs without holes, which makes
+// cloning a machine a single memcpy of a little over 4 KB.
+struct Chip8State {
+  uint64_t video[VIDEO_HEIGHT]{};  // one bit per pixel, MSB is column 0
+  uint8_t memory[4096]{};          // Chip8 has 4kb of ram
+  uint16_t stack[16]{};  // Chip8 uses stack to store the return address
+  uint8_t registers[16]{};  // Chip8 has 16 8bit registers
+  uint32_t rngState{1};     // xorshift32 state for OP_Cxkk
+  uint16_t keys{};    // keypad 0 to F, bit k set while key k is held
+  uint16_t index{};   // Chip8 has a 16bit index register to store address
+  uint16_t pc{};      // pc stores address of next instruction
+  uint16_t opcode{};  // Current instruction opcode
+  uint8_t sp{};       // sp points to top of stack
+  uint8_t delayTimer{};
+  uint8_t soundTimer{};
+};
+
+class Chip8 : public Chip8State {
+public:
+  using Chip8Func = void (Chip8::*)();
+
+  Chip8();
+
+  void LoadROM(std::string_view fileHandle);
+  void Cycle();
+
+  // Expands the 1bpp video rows into one 32bit pixel per screen pixel
+  void Render(uint32_t *pixels) const;
+
+public:
+  // Instructions
+  void OP_NULL();
+  void OP_00E0();
+  void OP_00EE();
+  void OP_1nnn();
+  void OP_2nnn();
+  void OP_3xkk();
+  void OP_4xkk();
+  void OP_5xy0();
+  void OP_6xkk();
+  void OP_7xkk();
+  void OP_8xy0();
+  void OP_8xy1();
+  void OP_8xy2();
+  void OP_8xy3();
+  void OP_8xy4();
+  void OP_8xy5();
+  void OP_8xy6();
+  void OP_8xy7();
+  void OP_8xyE();
+  void OP_9xy0();
+  void OP_Annn();
+  void OP_Bnnn();
+  void OP_Cxkk();
+  void OP_Dxyn();
+  void OP_Ex9E();
+  void OP_ExA1();
+  void OP_Fx07();
+  void OP_Fx0A();
+  void OP_Fx15();
+  void OP_Fx18();
+  void OP_Fx1E();
+  void OP_Fx29();
+  void OP_Fx33();
+  void OP_Fx55();
+  void OP_Fx65();
+
+  void Table0();
+  void Table8();
+  void TableE();
+  void TableF();
+
+  uint8_t RandomByte();
+
+public:
+  // Opcode Table, shared by every instance
+  static const std::array<Chip8Func, 0xF + 1> table;
+  static const std::array<Chip8Func, 0xE + 1> table0;
+  static const std::array<Chip8Func, 0xE + 1> table8;
+  static const std::array<Chip8Func, 0xE + 1> tableE;
+  static const std::array<Chip8Func, 0x65 + 1> tableF;
+};
+
+static_assert(std::is_trivially_copyable_v<Chip8>);
+static_assert(sizeof(Chip8) == sizeof(Chip8State));
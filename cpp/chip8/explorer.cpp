@@ -0,0 +1,230 @@
+#include "explorer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+
+namespace {
+
+// Caps the dedup table at 64 MB, a crowded table only loses sharing
+constexpr size_t MAX_SEEN{size_t{1} << 22};
+constexpr unsigned int SEEN_PROBE{16};
+
+// The state ends in padding that copies carry along but nothing
+// initializes, so it is left out of the hash
+constexpr size_t STATE_BYTES{offsetof(Chip8State, soundTimer) +
+                             sizeof(Chip8State::soundTimer)};
+
+constexpr uint64_t K0{0x9E3779B97F4A7C15};
+constexpr uint64_t K1{0xC2B2AE3D27D4EB4F};
+
+uint64_t Mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xFF51AFD7ED558CCD;
+  h ^= h >> 33;
+  h *= 0xC4CEB9FE1A85EC53;
+  h ^= h >> 33;
+  return h;
+}
+
+Explorer::Input InputAt(std::span<const Explorer::Input> inputs,
+                        unsigned int frame) {
+  return frame < inputs.size() ? inputs[frame] : 0;
+}
+
+void RunFrame(Chip8 &chip8, Explorer::Input input, unsigned int cycles) {
+  chip8.keys = input;
+  for (unsigned int cycle{0}; cycle < cycles; ++cycle) {
+    chip8.Cycle();
+  }
+  // keys are released between frames, so children that only differ in
+  // what they were pressing hash the same
+  chip8.keys = 0;
+}
+
+}  // namespace
+
+Explorer::Explorer(unsigned int threads) {
+  threads = std::max(threads, 1U);
+  workers.reserve(threads);
+  for (unsigned int i{0}; i < threads; ++i) {
+    workers.emplace_back(&Explorer::Work, this);
+  }
+}
+
+Explorer::~Explorer() {
+  stopping.store(true);
+  generation.fetch_add(1, std::memory_order_release);
+  generation.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+std::vector<Explorer::Result> Explorer::Explore(
+    const Chip8 &root, std::span<const std::vector<Input>> branches,
+    const Options &options, const ScoreFn &score) {
+  std::vector<Result> results(branches.size());
+  if (branches.empty()) {
+    return results;
+  }
+
+  // Room for every (branch, frame) pair at half load, within the cap
+  size_t want = std::bit_ceil(
+      std::clamp<size_t>(2 * branches.size() * options.frames, 1024, MAX_SEEN));
+  if (seenCap < want) {
+    seen = std::make_unique<Seen[]>(want);
+    seenCap = want;
+  }
+  // a small call after a large one only uses, and only clears, the front
+  // of the table
+  seenMask = want - 1;
+  for (size_t i{0}; i <= seenMask; ++i) {
+    seen[i].key.store(0, std::memory_order_relaxed);
+    seen[i].owner.store(NO_DUPLICATE, std::memory_order_relaxed);
+  }
+
+  job = Job{&root, branches, &options, &score, results.data()};
+  next.store(0, std::memory_order_relaxed);
+  running.store(workers.size(), std::memory_order_relaxed);
+  generation.fetch_add(1, std::memory_order_release);
+  generation.notify_all();
+
+  // Waiting for the workers to go idle, not just for the last branch, so
+  // none of them is still reading job when the next call rewrites it
+  for (uint32_t r; (r = running.load(std::memory_order_acquire)) != 0;) {
+    running.wait(r, std::memory_order_acquire);
+  }
+
+  // An owner always stopped at a later frame than its duplicates, so
+  // following the links ends at a branch that ran to the end
+  for (Result &result : results) {
+    uint32_t owner = result.duplicateOf;
+    if (owner == NO_DUPLICATE) {
+      continue;
+    }
+    while (results[owner].duplicateOf != NO_DUPLICATE) {
+      owner = results[owner].duplicateOf;
+    }
+    result = results[owner];
+    result.duplicateOf = owner;
+  }
+  return results;
+}
+
+Chip8 Explorer::Replay(const Chip8 &root, std::span<const Input> inputs,
+                       const Options &options) {
+  Chip8 child = root;
+  for (unsigned int frame{0}; frame < options.frames; ++frame) {
+    RunFrame(child, InputAt(inputs, frame), options.cyclesPerFrame);
+  }
+  return child;
+}
+
+uint64_t Explorer::Hash(const Chip8State &state) {
+  const auto *bytes = reinterpret_cast<const uint8_t *>(&state);
+  // independent lanes keep several multiplies in flight
+  constexpr int LANES{8};
+  uint64_t lanes[LANES];
+  for (int lane{0}; lane < LANES; ++lane) {
+    lanes[lane] = K1 + lane * K0;
+  }
+  size_t i{0};
+  for (; i + 8 * LANES <= STATE_BYTES; i += 8 * LANES) {
+    for (int lane{0}; lane < LANES; ++lane) {
+      uint64_t word;
+      std::memcpy(&word, bytes + i + 8 * lane, sizeof(word));
+      lanes[lane] = std::rotl((lanes[lane] ^ word) * K0, 31);
+    }
+  }
+  for (int lane{0}; i < STATE_BYTES; i += 8, ++lane) {
+    uint64_t word{0};
+    std::memcpy(&word, bytes + i, std::min<size_t>(8, STATE_BYTES - i));
+    lanes[lane] = std::rotl((lanes[lane] ^ word) * K0, 31);
+  }
+  uint64_t h{0};
+  for (int lane{0}; lane < LANES; ++lane) {
+    h = (h ^ lanes[lane]) * K1;
+  }
+  return Mix(h);
+}
+
+void Explorer::Work() {
+  std::vector<uint64_t> suffix;
+  uint32_t seenGeneration{0};
+  for (;;) {
+    generation.wait(seenGeneration, std::memory_order_acquire);
+    seenGeneration = generation.load(std::memory_order_acquire);
+    if (stopping.load()) {
+      return;
+    }
+    uint32_t count = job.branches.size();
+    for (uint32_t branch;
+         (branch = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+      RunBranch(job, branch, suffix);
+    }
+    if (running.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      running.notify_all();
+    }
+  }
+}
+
+void Explorer::RunBranch(const Job &job, uint32_t branch,
+                         std::vector<uint64_t> &suffix) {
+  const Options &options = *job.options;
+  std::span<const Input> inputs = job.branches[branch];
+  Result &result = job.results[branch];
+
+  // suffix[f] hashes the inputs of frames f and up, two children whose
+  // state and suffix agree after a frame end up in the same final state
+  suffix.resize(options.frames + 1);
+  suffix[options.frames] = K1;
+  for (unsigned int frame{options.frames}; frame-- > 0;) {
+    suffix[frame] = Mix(suffix[frame + 1] + InputAt(inputs, frame) + K0);
+  }
+
+  Chip8 child = *job.root;
+  for (unsigned int frame{0}; frame < options.frames; ++frame) {
+    RunFrame(child, InputAt(inputs, frame), options.cyclesPerFrame);
+    if (options.dedupEvery == 0 || (frame + 1) % options.dedupEvery != 0) {
+      continue;
+    }
+    uint64_t key = Mix(Hash(child) ^ suffix[frame + 1]);
+    uint32_t owner = Claim(key != 0 ? key : 1, branch);
+    if (owner != NO_DUPLICATE) {
+      result.duplicateOf = owner;
+      return;
+    }
+  }
+  result.score = (*job.score)(child);
+  result.hash = Hash(child);
+}
+
+uint32_t Explorer::Claim(uint64_t key, uint32_t branch) {
+  size_t i = key & seenMask;
+  for (unsigned int probe{0}; probe < SEEN_PROBE;
+       ++probe, i = (i + 1) & seenMask) {
+    Seen &slot = seen[i];
+    uint64_t found = slot.key.load(std::memory_order_acquire);
+    if (found == 0) {
+      if (slot.key.compare_exchange_strong(found, key,
+                                           std::memory_order_acq_rel)) {
+        slot.owner.store(branch, std::memory_order_release);
+        return NO_DUPLICATE;
+      }
+      // found now holds whatever key beat us to the slot
+    }
+    if (found == key) {
+      // the winner publishes its branch right after the key
+      uint32_t owner;
+      while ((owner = slot.owner.load(std::memory_order_acquire)) ==
+             NO_DUPLICATE) {
+        std::this_thread::yield();
+      }
+      return owner != branch ? owner : NO_DUPLICATE;
+    }
+  }
+  // too crowded here, run on without sharing
+  return NO_DUPLICATE;
+}
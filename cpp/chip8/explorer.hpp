@@ -0,0 +1,107 @@
+#pragma once
+
+#include "chip8.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <thread>
+#include <vector>
+
+// Forks a machine into many children and plays a different keypad input
+// sequence into each of them on a pool of worker threads.
+//
+// A child is a plain copy of the root, Chip8 is trivially copyable so
+// forking costs a memcpy. Every input holds a keypad bitmask, bit k being
+// key k, for one frame of cyclesPerFrame cycles.
+//
+// After each frame a child looks its state up in a lock-free set keyed by
+// the state hash and the hash of its remaining inputs. Two children that
+// meet there are bound to end up identical, so the later one stops and is
+// reported as a duplicate of the first instead of being run and scored
+// again. Results land in a slot per branch, so collecting them takes no
+// lock either.
+class Explorer {
+public:
+  using Input = uint16_t;
+  // Called from the worker threads, must be safe to run concurrently
+  using ScoreFn = std::function<double(const Chip8State &)>;
+
+  static constexpr uint32_t NO_DUPLICATE{UINT32_MAX};
+
+  struct Options {
+    unsigned int frames{60};  // frames every branch runs for, frames past
+                              // the end of its inputs hold no keys
+    unsigned int cyclesPerFrame{10};
+    // Frames between two dedup lookups, 0 turns dedup off. Hashing the
+    // state costs more than running a frame, so ROMs whose branches rarely
+    // meet run faster with a larger interval
+    unsigned int dedupEvery{1};
+  };
+
+  struct Result {
+    double score{};
+    uint64_t hash{};  // hash of the final machine state
+    // for a branch cut short, the branch that ran on and whose score and
+    // hash it shares
+    uint32_t duplicateOf{NO_DUPLICATE};
+  };
+
+  explicit Explorer(unsigned int threads = std::thread::hardware_concurrency());
+  Explorer(const Explorer &) = delete;
+  Explorer(const Explorer &&) = delete;
+  Explorer &operator=(const Explorer &) = delete;
+  Explorer &operator=(const Explorer &&) = delete;
+  ~Explorer();
+
+public:
+  // Runs one child of root per entry of branches and returns their results
+  // in the same order. Blocks until every branch is done
+  std::vector<Result> Explore(const Chip8 &root,
+                              std::span<const std::vector<Input>> branches,
+                              const Options &options, const ScoreFn &score);
+
+  // Replays a single branch on the calling thread, to pick up the machine
+  // a promising result came from
+  static Chip8 Replay(const Chip8 &root, std::span<const Input> inputs,
+                      const Options &options);
+
+  // 64bit hash of everything a machine mutates. Collisions would merge two
+  // different branches, at 64 bits they are not a practical concern
+  static uint64_t Hash(const Chip8State &state);
+
+private:
+  // A key of 0 marks a free slot, owner is published after the key
+  struct Seen {
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> owner;
+  };
+
+  struct Job {
+    const Chip8 *root;
+    std::span<const std::vector<Input>> branches;
+    const Options *options;
+    const ScoreFn *score;
+    Result *results;
+  };
+
+  void Work();
+  void RunBranch(const Job &job, uint32_t branch,
+                 std::vector<uint64_t> &suffix);
+  // return the branch that claimed key first, or NO_DUPLICATE if it was us
+  uint32_t Claim(uint64_t key, uint32_t branch);
+
+private:
+  std::vector<std::thread> workers;
+  Job job{};
+  std::unique_ptr<Seen[]> seen;
+  size_t seenCap{};   // slots allocated
+  size_t seenMask{};  // slots in use by the current call, minus one
+
+  alignas(64) std::atomic<uint32_t> next{0};  // next branch to hand out
+  alignas(64) std::atomic<uint32_t> running{0};  // workers still busy
+  alignas(64) std::atomic<uint32_t> generation{0};  // bumped per Explore
+  std::atomic<bool> stopping{false};
+};
@@ -0,0 +1,56 @@
+#include "input.hpp"
+
+#include <fmt/core.h>
+
+#include <algorithm>
+
+void InputQueue::Push(uint8_t key, bool pressed, Clock::time_point when) {
+  pending.push_back({when, static_cast<uint8_t>(key & 0x0FU), pressed});
+}
+
+uint16_t InputQueue::Apply(uint16_t keys, Clock::time_point now) {
+  uint16_t changed{0};
+  size_t applied{0};
+  for (; applied < pending.size(); ++applied) {
+    const Event &event = pending[applied];
+    uint16_t bit = 1U << event.key;
+    // sources stamp their own events, so a late arrival may carry an older
+    // time than what is queued ahead of it; order is kept regardless
+    if (event.when > now || (changed & bit)) {
+      break;
+    }
+    keys = event.pressed ? keys | bit : keys & ~bit;
+    changed |= bit;
+    if (!awaitingPresent) {
+      oldestApplied = event.when;
+      awaitingPresent = true;
+    }
+  }
+  pending.erase(pending.begin(), pending.begin() + applied);
+  return keys;
+}
+
+void InputQueue::Presented(Clock::time_point now) {
+  if (!awaitingPresent) {
+    return;
+  }
+  awaitingPresent = false;
+  auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+      now - oldestApplied);
+  latencies.push_back(std::max<int64_t>(us.count(), 0));
+}
+
+void InputQueue::Report() const {
+  if (latencies.empty()) {
+    return;
+  }
+  std::vector<uint32_t> sorted{latencies};
+  std::sort(sorted.begin(), sorted.end());
+  auto at = [&](double q) {
+    return sorted[static_cast<size_t>(q * (sorted.size() - 1))] / 1000.0;
+  };
+  fmt::println(stderr,
+               "input to present latency over {} events: p50 {:.2f}ms "
+               "p99 {:.2f}ms max {:.2f}ms",
+               sorted.size(), at(0.5), at(0.99), sorted.back() / 1000.0);
+}
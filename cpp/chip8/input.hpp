@@ -0,0 +1,44 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Key events from every source, the local keyboard and remote spectators,
+// stamped with the host time they happened and applied to the keypad
+// bitmask at cycle boundaries.
+//
+// A cycle sees every event stamped at or before its start, in order, but at
+// most one transition per key: a press and release that land in the same
+// cycle are split over two so the program gets to see the press.
+//
+// It also measures input to present latency. The first event applied after
+// a present starts the clock and the next present stops it, so each sample
+// covers queueing, the cycle delay and rendering.
+class InputQueue {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  void Push(uint8_t key, bool pressed, Clock::time_point when);
+
+  // Applies the events due by now to keys
+  uint16_t Apply(uint16_t keys, Clock::time_point now);
+
+  // Called right after a frame reached the screen
+  void Presented(Clock::time_point now);
+
+  // Prints latency percentiles to stderr, if anything was measured
+  void Report() const;
+
+private:
+  struct Event {
+    Clock::time_point when;
+    uint8_t key;
+    bool pressed;
+  };
+
+  std::vector<Event> pending;  // in arrival order
+  Clock::time_point oldestApplied{};
+  bool awaitingPresent{false};
+  std::vector<uint32_t> latencies;  // microseconds
+};
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// PackBits: a control byte n < 128 is followed by n + 1 literal bytes,
+// n >= 128 repeats the following byte 257 - n times
+inline void PackBits(std::vector<uint8_t> &out, const uint8_t *data,
+                     size_t len) {
+  size_t i{0};
+  while (i < len) {
+    size_t run{1};
+    while (i + run < len && run < 128 && data[i + run] == data[i]) {
+      ++run;
+    }
+    if (run >= 2) {
+      out.push_back(static_cast<uint8_t>(257 - run));
+      out.push_back(data[i]);
+      i += run;
+      continue;
+    }
+    size_t start{i};
+    while (i < len && i - start < 128 &&
+           (i + 1 >= len || data[i + 1] != data[i])) {
+      ++i;
+    }
+    out.push_back(static_cast<uint8_t>(i - start - 1));
+    out.insert(out.end(), data + start, data + i);
+  }
+}
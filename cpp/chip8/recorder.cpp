@@ -0,0 +1,160 @@
+#include "recorder.hpp"
+
+#include "packbits.hpp"
+
+#include <fmt/core.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+void PutLE(std::vector<uint8_t> &out, uint64_t v, int bytes) {
+  for (int i{0}; i < bytes; ++i) {
+    out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+  }
+}
+
+}  // namespace
+
+Recorder::~Recorder() {
+  Close();
+}
+
+bool Recorder::Open(std::string_view path, Format format, bool waitWhenFull) {
+  Close();
+  this->path = path;
+  this->format = format;
+  this->waitWhenFull = waitWhenFull;
+  std::memset(lastRows, 0, sizeof(lastRows));
+  dropped = 0;
+
+  if (format == Format::RLE) {
+    file = std::fopen(this->path.c_str(), "wb");
+    if (file == nullptr) {
+      fmt::println(stderr, "failed to open {}: {}", path, strerror(errno));
+      return false;
+    }
+    const uint8_t header[8]{'C', '8', 'R', 'L', 1, COLUMNS, ROWS, 0};
+    std::fwrite(header, 1, sizeof(header), file);
+  }
+  stopping.store(false);
+  worker = std::thread(&Recorder::Run, this);
+  return true;
+}
+
+bool Recorder::Submit(const uint64_t *rows, uint64_t cycle) {
+  uint32_t h = head.load(std::memory_order_relaxed);
+  while (h - tail.load(std::memory_order_acquire) == SLOTS) {
+    if (!waitWhenFull) {
+      ++dropped;
+      return false;
+    }
+    Wake();
+    std::this_thread::yield();
+  }
+  Slot &slot = slots[h & (SLOTS - 1)];
+  slot.cycle = cycle;
+  std::memcpy(slot.rows, rows, sizeof(slot.rows));
+  // seq_cst, so either the worker sees this frame when it looks again
+  // after raising sleeping, or we see sleeping raised below
+  head.store(h + 1);
+  Wake();
+  return true;
+}
+
+void Recorder::Wake() {
+  // the load is seq_cst too, a relaxed one could move ahead of the head
+  // store in Submit and miss the worker raising sleeping
+  if (sleeping.load() && sleeping.exchange(false)) {
+    sleeping.notify_one();
+  }
+}
+
+void Recorder::Close() {
+  if (!worker.joinable()) {
+    return;
+  }
+  stopping.store(true);
+  sleeping.store(false);
+  sleeping.notify_one();
+  worker.join();
+  if (file != nullptr) {
+    if (std::fclose(file) != 0) {
+      fmt::println(stderr, "failed to write {}: {}", path, strerror(errno));
+    }
+    file = nullptr;
+  }
+  if (dropped > 0) {
+    fmt::println(stderr, "recorder dropped {} frames", dropped);
+  }
+}
+
+void Recorder::Run() {
+  for (;;) {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t h = head.load(std::memory_order_acquire);
+    if (t == h) {
+      if (stopping.load()) {
+        return;
+      }
+      // announce the nap, then look once more for a frame submitted before
+      // Submit could have seen the flag
+      sleeping.store(true);
+      if (head.load() != t || stopping.load()) {
+        sleeping.store(false);
+        continue;
+      }
+      sleeping.wait(true);
+      continue;
+    }
+    for (; t != h; ++t) {
+      Encode(slots[t & (SLOTS - 1)]);
+      tail.store(t + 1, std::memory_order_release);
+    }
+  }
+}
+
+void Recorder::Encode(const Slot &slot) {
+  if (format == Format::PBM) {
+    WritePBM(fmt::format("{}-{:08}.pbm", path, slot.cycle), slot.rows);
+    return;
+  }
+
+  uint8_t delta[ROWS * sizeof(uint64_t)];
+  size_t n{0};
+  for (unsigned int row{0}; row < ROWS; ++row) {
+    uint64_t bits = slot.rows[row] ^ lastRows[row];
+    for (int byte{7}; byte >= 0; --byte) {
+      delta[n++] = static_cast<uint8_t>(bits >> (8 * byte));
+    }
+    lastRows[row] = slot.rows[row];
+  }
+  packed.clear();
+  PutLE(packed, slot.cycle, 8);
+  PutLE(packed, 0, 4);  // length, patched below
+  PackBits(packed, delta, n);
+  uint32_t len = packed.size() - 12;
+  for (int i{0}; i < 4; ++i) {
+    packed[8 + i] = static_cast<uint8_t>(len >> (8 * i));
+  }
+  std::fwrite(packed.data(), 1, packed.size(), file);
+}
+
+bool Recorder::WritePBM(const std::string &path, const uint64_t *rows) {
+  std::FILE *out = std::fopen(path.c_str(), "wb");
+  if (out == nullptr) {
+    fmt::println(stderr, "failed to open {}: {}", path, strerror(errno));
+    return false;
+  }
+  // P4 stores rows MSB first with 1 as black, lit pixels are drawn black
+  std::fprintf(out, "P4\n%u %u\n", COLUMNS, ROWS);
+  for (unsigned int row{0}; row < ROWS; ++row) {
+    uint8_t bytes[sizeof(uint64_t)];
+    for (int byte{0}; byte < 8; ++byte) {
+      bytes[byte] = static_cast<uint8_t>(rows[row] >> (8 * (7 - byte)));
+    }
+    std::fwrite(bytes, 1, sizeof(bytes), out);
+  }
+  return std::fclose(out) == 0;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Records the emulator screen from a background encoder thread.
+//
+// The emulator copies chip8.video into one of SLOTS preallocated slots of a
+// single producer, single consumer ring and moves on; encoding and file I/O
+// happen on the worker. A full ring drops the frame rather than stall the
+// emulator, unless the recorder was opened with waitWhenFull, which headless
+// runs use since they have no frame deadline to keep.
+//
+// RLE container, little endian:
+//   "C8RL" | u8 version (1) | u8 width | u8 height | u8 reserved
+//   then per frame: u64 cycle | u32 packed length | packed bytes
+// where the packed bytes are PackBits of the frame XOR the previous frame,
+// 8 bytes per row, MSB first. The first frame is XORed against a blank
+// screen.
+//
+// PBM mode writes every frame as its own P4 image, <path>-<cycle>.pbm.
+class Recorder {
+public:
+  static constexpr unsigned int ROWS{32};
+  static constexpr unsigned int COLUMNS{64};
+  static constexpr unsigned int SLOTS{256};  // a power of two
+
+  enum class Format { RLE, PBM };
+
+  Recorder() = default;
+  Recorder(const Recorder &) = delete;
+  Recorder(const Recorder &&) = delete;
+  Recorder &operator=(const Recorder &) = delete;
+  Recorder &operator=(const Recorder &&) = delete;
+  ~Recorder();
+
+public:
+  bool Open(std::string_view path, Format format, bool waitWhenFull = false);
+  bool Recording() const { return worker.joinable(); }
+
+  // Queues a copy of rows taken on the given cycle, returns false if the
+  // frame was dropped
+  bool Submit(const uint64_t *rows, uint64_t cycle);
+
+  // Encodes everything still queued and stops the worker
+  void Close();
+
+  // Writes rows as a P4 PBM image
+  static bool WritePBM(const std::string &path, const uint64_t *rows);
+
+private:
+  struct Slot {
+    uint64_t cycle;
+    uint64_t rows[ROWS];
+  };
+
+  void Run();
+  void Encode(const Slot &slot);
+  // Clears sleeping and wakes the worker if it was set
+  void Wake();
+
+private:
+  std::array<Slot, SLOTS> slots{};
+  // head is only written by the emulator and tail only by the worker, each
+  // on its own cache line so the two sides do not bounce one between them
+  alignas(64) std::atomic<uint32_t> head{0};
+  alignas(64) std::atomic<uint32_t> tail{0};
+  // Raised by the worker before it waits on an empty ring, whoever clears
+  // it owes the worker a notify
+  alignas(64) std::atomic<bool> sleeping{false};
+  std::atomic<bool> stopping{false};
+  bool waitWhenFull{false};
+  uint64_t dropped{0};
+
+  std::thread worker;
+  Format format{Format::RLE};
+  std::string path;
+  std::FILE *file{nullptr};
+  uint64_t lastRows[ROWS]{};  // encoder side, previous frame for the XOR
+  std::vector<uint8_t> packed;
+};
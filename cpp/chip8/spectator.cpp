@@ -0,0 +1,242 @@
+#include "spectator.hpp"
+
+#include "packbits.hpp"
+
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
+namespace {
+
+// Frame types of the pollserver wire protocol, see c/frame.h
+constexpr uint8_t FRAME_MSG{1};
+constexpr uint8_t FRAME_JOIN{2};
+constexpr uint8_t FRAME_LEAVE{3};
+constexpr uint8_t FRAME_PING{4};
+constexpr uint8_t FRAME_PONG{5};
+constexpr uint8_t FRAME_HISTORY{6};
+
+void PutVarint(std::vector<uint8_t> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back(static_cast<uint8_t>(v | 0x80U));
+    v >>= 7U;
+  }
+  out.push_back(static_cast<uint8_t>(v));
+}
+
+void PutU32(std::vector<uint8_t> &out, uint32_t v) {
+  for (int i{0}; i < 4; ++i) {
+    out.push_back(static_cast<uint8_t>(v >> (8 * i)));
+  }
+}
+
+}  // namespace
+
+Spectator::~Spectator() {
+  Disconnect();
+}
+
+bool Spectator::Connect(std::string_view address) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string_view::npos) {
+    fmt::println(stderr, "spectate address must be host:port[/channel]");
+    return false;
+  }
+  std::string host{address.substr(0, colon)};
+  std::string port{address.substr(colon + 1)};
+  channel = "chip8";
+  if (size_t slash = port.find('/'); slash != std::string::npos) {
+    channel = port.substr(slash + 1);
+    port.resize(slash);
+  }
+  inputChannel = channel + "/input";
+  if (inputChannel.size() > 255) {
+    fmt::println(stderr, "spectate channel name is too long");
+    return false;
+  }
+
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *res{};
+  if (int rv = getaddrinfo(host.c_str(), port.c_str(), &hints, &res); rv) {
+    fmt::println(stderr, "getaddrinfo: {}", gai_strerror(rv));
+    return false;
+  }
+  for (addrinfo *p = res; p != nullptr; p = p->ai_next) {
+    fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (connect(fd, p->ai_addr, p->ai_addrlen) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+    fmt::println(stderr, "failed to connect to spectator server {}", address);
+    Disconnect();
+    return false;
+  }
+
+  // Stay out of the lobby chat and listen for spectator key presses
+  QueueControl(FRAME_LEAVE, "");
+  QueueControl(FRAME_JOIN, inputChannel);
+  Flush();
+  return Connected();
+}
+
+void Spectator::QueueControl(uint8_t type, std::string_view name) {
+  PutVarint(out, name.size());
+  out.push_back(type);
+  out.insert(out.end(), name.begin(), name.end());
+}
+
+void Spectator::QueueFrame(uint8_t type, std::string_view chan,
+                           const uint8_t *data, size_t len) {
+  PutVarint(out, 1 + chan.size() + len);
+  out.push_back(type);
+  out.push_back(static_cast<uint8_t>(chan.size()));
+  out.insert(out.end(), chan.begin(), chan.end());
+  out.insert(out.end(), data, data + len);
+}
+
+void Spectator::Publish(const uint64_t *rows) {
+  if (!Connected()) {
+    return;
+  }
+  Flush();
+
+  // A viewer that fell behind is better served by a fresh keyframe than by
+  // a growing pile of stale deltas
+  if (out.size() > MAX_BACKLOG) {
+    sinceKeyframe = KEYFRAME_INTERVAL;
+    return;
+  }
+
+  bool keyframe = sinceKeyframe >= KEYFRAME_INTERVAL;
+  uint32_t mask{0};
+  for (unsigned int row{0}; row < ROWS; ++row) {
+    if (keyframe || rows[row] != lastRows[row]) {
+      mask |= 1U << row;
+    }
+  }
+  ++sinceKeyframe;
+  if (mask == 0) {
+    return;
+  }
+  if (keyframe) {
+    sinceKeyframe = 0;
+  }
+
+  uint8_t changed[ROWS * sizeof(uint64_t)];
+  size_t n{0};
+  for (unsigned int row{0}; row < ROWS; ++row) {
+    if (mask & (1U << row)) {
+      for (int byte{7}; byte >= 0; --byte) {
+        changed[n++] = static_cast<uint8_t>(rows[row] >> (8 * byte));
+      }
+      lastRows[row] = rows[row];
+    }
+  }
+
+  body.clear();
+  body.push_back(keyframe ? KEYFRAME : DELTA);
+  PutU32(body, sequence++);
+  PutU32(body, mask);
+  PackBits(body, changed, n);
+  QueueFrame(FRAME_MSG, channel, body.data(), body.size());
+  Flush();
+}
+
+void Spectator::PollInput(InputQueue &input) {
+  if (!Connected()) {
+    return;
+  }
+  uint8_t buf[4096];
+  for (;;) {
+    ssize_t nbytes = recv(fd, buf, sizeof(buf), 0);
+    if (nbytes > 0) {
+      in.insert(in.end(), buf, buf + nbytes);
+      continue;
+    }
+    if (nbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      fmt::println(stderr, "spectator server went away");
+      Disconnect();
+      return;
+    }
+    break;
+  }
+
+  // spectators run on other clocks, so events are stamped on arrival
+  auto now = InputQueue::Clock::now();
+  size_t pos{0};
+  while (pos < in.size()) {
+    uint64_t len{0};
+    size_t hdr{0};
+    bool complete{false};
+    for (int shift{0}; pos + hdr < in.size() && shift < 64; shift += 7) {
+      uint8_t b = in[pos + hdr++];
+      len |= uint64_t{b & 0x7FU} << shift;
+      if (!(b & 0x80U)) {
+        complete = true;
+        break;
+      }
+    }
+    if (!complete || in.size() - pos - hdr < 1 + len) {
+      break;
+    }
+    const uint8_t *payload = &in[pos + hdr + 1];
+    if (in[pos + hdr] == FRAME_PING) {
+      QueueControl(FRAME_PONG, "");
+    } else if (in[pos + hdr] == FRAME_HISTORY) {
+      // keys pressed for an earlier session, replayed because we joined
+    } else if (in[pos + hdr] == FRAME_MSG && len >= 3 &&
+               len >= 1 + payload[0] + 2u) {
+      std::string_view chan{reinterpret_cast<const char *>(payload + 1),
+                            payload[0]};
+      const uint8_t *event = payload + 1 + payload[0];
+      if (chan == inputChannel && event[0] < 16) {
+        input.Push(event[0], event[1] != 0, now);
+      }
+    }
+    pos += hdr + 1 + len;
+  }
+  in.erase(in.begin(), in.begin() + pos);
+  if (!out.empty()) {
+    Flush();
+  }
+}
+
+void Spectator::Flush() {
+  size_t sent{0};
+  while (sent < out.size()) {
+    ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        fmt::println(stderr, "spectator stream failed: {}", strerror(errno));
+        Disconnect();
+        return;
+      }
+      break;
+    }
+    sent += n;
+  }
+  out.erase(out.begin(), out.begin() + sent);
+}
+
+void Spectator::Disconnect() {
+  if (fd != -1) {
+    close(fd);
+    fd = -1;
+  }
+  out.clear();
+  in.clear();
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "input.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Streams the emulator screen to a pollserver channel and feeds the key
+// events spectators send back into the keypad.
+//
+// Every video message body is encoded once and fanned out by the server,
+// so the number of watchers costs the emulator nothing. Layout, little
+// endian:
+//   u8 kind (0 keyframe, 1 delta) | u32 sequence | u32 changed row mask |
+//   PackBits compressed bytes of the changed rows, 8 bytes per row, MSB first
+// Only rows that differ from the previous frame are sent, and a static
+// screen sends nothing but a keyframe every KEYFRAME_INTERVAL publishes.
+//
+// Spectators publish two byte messages on "<channel>/input": key, pressed.
+// The history the server replays on joining that channel is ignored.
+class Spectator {
+public:
+  static constexpr unsigned int ROWS{32};
+  static constexpr unsigned int KEYFRAME_INTERVAL{60};
+  static constexpr size_t MAX_BACKLOG{64 * 1024};
+
+  enum FrameKind : uint8_t { KEYFRAME = 0, DELTA = 1 };
+
+  Spectator() = default;
+  Spectator(const Spectator &) = delete;
+  Spectator(const Spectator &&) = delete;
+  Spectator &operator=(const Spectator &) = delete;
+  Spectator &operator=(const Spectator &&) = delete;
+  ~Spectator();
+
+public:
+  // address is host:port[/channel], the channel defaults to "chip8"
+  bool Connect(std::string_view address);
+  bool Connected() const { return fd != -1; }
+
+  // Publishes the rows that changed since the last call
+  void Publish(const uint64_t *rows);
+
+  // Queues the key events spectators sent since the last call
+  void PollInput(InputQueue &input);
+
+private:
+  // JOIN and LEAVE carry a bare channel name
+  void QueueControl(uint8_t type, std::string_view name);
+  // MSG payloads are prefixed with the channel they are published on
+  void QueueFrame(uint8_t type, std::string_view chan, const uint8_t *data,
+                  size_t len);
+  void Flush();
+  void Disconnect();
+
+private:
+  int fd{-1};
+  std::string channel;
+  std::string inputChannel;
+  uint64_t lastRows[ROWS]{};
+  uint32_t sequence{};
+  unsigned int sinceKeyframe{KEYFRAME_INTERVAL};  // first publish is a keyframe
+  std::vector<uint8_t> out;    // frames waiting for the socket
+  std::vector<uint8_t> in;     // bytes received but not parsed yet
+  std::vector<uint8_t> body;   // encoding scratch, reused every frame
+};